@@ -1,17 +1,24 @@
 /* Implementation of simple command-line interface */
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "console.h"
+#include "dudect/cpucycles.h"
+#include "histogram.h"
+#include "perf.h"
 #include "report.h"
 #include "web.h"
 
@@ -20,6 +27,11 @@ int simulation = 0;
 int show_entropy = 0;
 static cmd_element_t *cmd_list = NULL;
 static param_element_t *param_list = NULL;
+
+/* Open-addressed hash table of commands, at most half full */
+static cmd_element_t **cmd_table = NULL;
+static size_t cmd_table_size = 0;
+static size_t cmd_cnt = 0;
 static bool block_flag = false;
 static bool prompt_flag = true;
 
@@ -35,17 +47,74 @@ static double first_time, last_time;
 
 #define RIO_BUFSIZE 8192
 
+/* Regular files up to this size are compiled before being executed, larger
+ * ones are executed line by line straight from their mapping.
+ */
+#define COMPILE_LIMIT (16 << 20)
+
+/* Command line split and resolved ahead of execution */
+typedef struct {
+    cmd_element_t *cmd; /* Matching command, NULL if unknown */
+    int argc;
+    char **argv;
+    char *line; /* Original text with newline, for echoing */
+} cmd_op_t;
+
+/* Commands of a whole file, all stored in three allocations */
+typedef struct {
+    cmd_op_t *ops;
+    size_t op_cnt;
+    char **args; /* Argument vectors of all commands */
+    size_t arg_cnt;
+    char *text; /* Lines and arguments of all commands */
+    size_t text_size;
+    size_t pc; /* Next command to execute */
+} cmd_prog_t;
+
+/* Maximum nesting of blocks and loop variables */
+#define MAXBLOCK 16
+
+typedef struct __cmd_block cmd_block_t;
+
+/* Command of a block, copied when the block is read */
+typedef struct {
+    cmd_op_t op;
+    cmd_block_t *body; /* Block following the command, NULL if none */
+    char **sub_argv;   /* Arguments after '$' substitution, NULL if none */
+    char *sub_buf;     /* Text of substituted arguments */
+    size_t sub_size;
+} block_op_t;
+
+/* Commands between '{' and '}', parsed once and executed many times */
+struct __cmd_block {
+    block_op_t *ops;
+    int op_cnt;
+    int op_size;
+};
+
 typedef struct __rio {
     int fd;                /* File descriptor */
     int count;             /* Unread bytes in internal buffer */
     char *bufptr;          /* Next unread byte in internal buffer */
     char buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *map;             /* Mapped file, NULL to read through buf */
+    size_t map_size;       /* Length of mapped file */
+    size_t map_pos;        /* Start of next line in mapped file */
+    cmd_prog_t *prog;      /* Compiled file, NULL to read line by line */
+    bool busy;             /* Executing a command from prog */
+    bool popped;           /* Popped while busy; free once command returns */
     struct __rio *prev;    /* Next element in stack */
 } rio_t;
 
 static rio_t *buf_stack;
 static char linebuf[RIO_BUFSIZE];
 
+/* Reusable storage for the arguments of the command being interpreted */
+static char *arg_buf = NULL;
+static size_t arg_buf_size = 0;
+static char **arg_vec = NULL;
+static size_t arg_vec_size = 0;
+
 /* Maximum file descriptor */
 static int fd_max = 0;
 
@@ -53,6 +122,23 @@ static int fd_max = 0;
 static int err_limit = 5;
 static int err_cnt = 0;
 static int echo = 0;
+static int histo = 0;
+static int perf = 0;
+
+/* Blocks being read: outermost command and innermost open blocks */
+static cmd_block_t *block_root = NULL;
+static cmd_block_t *block_stack[MAXBLOCK];
+static int block_depth = 0;
+
+/* Block handed to the command being executed, taken by take_block */
+static cmd_block_t *cur_block = NULL;
+
+/* Loop variables, innermost last */
+static struct {
+    const char *name;
+    long value;
+} loop_vars[MAXBLOCK];
+static int loop_var_cnt = 0;
 
 static bool quit_flag = false;
 static char *prompt = "cmd> ";
@@ -65,12 +151,64 @@ static bool has_infile = false;
 static cmd_func_t quit_helpers[MAXQUIT];
 static int quit_helper_cnt = 0;
 
+/* Maximum number of command hooks */
+#define MAXHOOK 10
+
+/* Optional functions to call around every command */
+static cmd_hook_t before_hooks[MAXHOOK];
+static cmd_hook_t after_hooks[MAXHOOK];
+static int cmd_hook_cnt = 0;
+
 static void init_in(void);
+static void free_cmd_block(cmd_block_t *b);
 
 static bool push_file(char *fname);
 static void pop_file(void);
 
-static bool interpret_cmda(int argc, char *argv[]);
+/* FNV-1a hash of a command name */
+static size_t cmd_hash(const char *name)
+{
+    size_t h = (size_t) 0xcbf29ce484222325ULL;
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= (size_t) 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static void cmd_table_insert(cmd_element_t *cmd)
+{
+    size_t mask = cmd_table_size - 1;
+    size_t i = cmd_hash(cmd->name) & mask;
+    while (cmd_table[i] && strcmp(cmd_table[i]->name, cmd->name))
+        i = (i + 1) & mask;
+    cmd_table[i] = cmd;
+}
+
+/* Find command by name, or NULL if there is none */
+static cmd_element_t *find_cmd(const char *name)
+{
+    if (!cmd_table)
+        return NULL;
+
+    size_t mask = cmd_table_size - 1;
+    size_t i = cmd_hash(name) & mask;
+    while (cmd_table[i]) {
+        if (!strcmp(cmd_table[i]->name, name))
+            return cmd_table[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+static void free_cmd_table(void)
+{
+    if (cmd_table)
+        free_array(cmd_table, cmd_table_size, sizeof(cmd_element_t *));
+    cmd_table = NULL;
+    cmd_table_size = 0;
+    cmd_cnt = 0;
+}
 
 /* Add a new command */
 void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
@@ -87,8 +225,22 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
     cmd->operation = operation;
     cmd->summary = summary;
     cmd->param = param;
+    cmd->histo = NULL;
     cmd->next = next_cmd;
     *last_loc = cmd;
+
+    /* Grow and rebuild the hash table to keep it at most half full */
+    if (++cmd_cnt * 2 > cmd_table_size) {
+        size_t cnt = cmd_cnt;
+        size_t size = cmd_table_size ? cmd_table_size * 2 : 64;
+        free_cmd_table();
+        cmd_table = calloc_or_fail(size, sizeof(cmd_element_t *), "add_cmd");
+        cmd_table_size = size;
+        cmd_cnt = cnt;
+        for (cmd_element_t *c = cmd_list; c; c = c->next)
+            cmd_table_insert(c);
+    } else
+        cmd_table_insert(cmd);
 }
 
 /* Add a new parameter */
@@ -111,24 +263,19 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter)
     *last_loc = param;
 }
 
-/* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp)
+/* Split the len characters of line into words at white space.
+ * Words are copied null-terminated into dst, which needs room for len + 1
+ * characters, and recorded in argv, which needs room for (len + 1) / 2
+ * entries.  Return the number of words.
+ */
+static int split_args(const char *line, size_t len, char *dst, char **argv)
 {
-    /* Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
-
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
-
-    char *src = line;
-    char *dst = buf;
+    const char *src = line;
+    const char *end = line + len;
     bool skipping = true;
     int c;
     int argc = 0;
-    while ((c = *src++) != '\0') {
+    while (src < end && (c = *src++) != '\0') {
         if (isspace(c)) {
             if (!skipping) {
                 /* Hit end of word */
@@ -138,7 +285,7 @@ static char **parse_args(char *line, int *argcp)
         } else {
             if (skipping) {
                 /* Hit start of new word */
-                argc++;
+                argv[argc++] = dst;
                 skipping = false;
             }
             *dst++ = c;
@@ -146,18 +293,31 @@ static char **parse_args(char *line, int *argcp)
     }
     /* Let the last substring is null-terminated */
     *dst++ = '\0';
+    return argc;
+}
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
+/* Parse len characters of a string into a command line.
+ * Arguments are split into storage reused by every call, so they are only
+ * valid until the next command line is parsed.
+ */
+static char **parse_args(const char *line, size_t len, int *argcp)
+{
+    /* A line of len characters holds at most (len + 1) / 2 words */
+    if (len + 1 > arg_buf_size) {
+        if (arg_buf)
+            free_block(arg_buf, arg_buf_size);
+        arg_buf_size = len + 1 > RIO_BUFSIZE ? len + 1 : RIO_BUFSIZE;
+        arg_buf = malloc_or_fail(arg_buf_size, "parse_args");
+    }
+    if ((len + 1) / 2 + 1 > arg_vec_size) {
+        if (arg_vec)
+            free_array(arg_vec, arg_vec_size, sizeof(char *));
+        arg_vec_size = (len + 1) / 2 + 1;
+        arg_vec = calloc_or_fail(arg_vec_size, sizeof(char *), "parse_args");
     }
 
-    free_block(buf, len + 1);
-    *argcp = argc;
-    return argv;
+    *argcp = split_args(line, len, arg_buf, arg_vec);
+    return arg_vec;
 }
 
 /* Handles forced console termination for record_error and do_quit */
@@ -168,8 +328,12 @@ static bool force_quit(int argc, char *argv[])
     while (c) {
         cmd_element_t *ele = c;
         c = c->next;
+        if (ele->histo)
+            free_block(ele->histo, sizeof(histogram_t));
         free_block(ele, sizeof(cmd_element_t));
     }
+    cmd_list = NULL;
+    free_cmd_table();
 
     param_element_t *p = param_list;
     while (p) {
@@ -181,6 +345,18 @@ static bool force_quit(int argc, char *argv[])
     while (buf_stack)
         pop_file();
 
+    if (perf) {
+        perf_close();
+        perf = 0;
+    }
+
+    if (block_root) {
+        report(1, "Discarding unterminated block");
+        free_cmd_block(block_root);
+        block_root = NULL;
+        block_depth = 0;
+    }
+
     for (int i = 0; i < quit_helper_cnt; i++) {
         ok = ok && quit_helpers[i](argc, argv);
     }
@@ -200,18 +376,72 @@ static void record_error(void)
     }
 }
 
-/* Execute a command that has already been split into arguments */
-static bool interpret_cmda(int argc, char *argv[])
+/* Latency histogram of a command, allocated when first needed */
+static histogram_t *cmd_histo(cmd_element_t *cmd)
+{
+    if (!cmd->histo) {
+        cmd->histo = malloc_or_fail(sizeof(histogram_t), "cmd_histo");
+        histo_reset(cmd->histo);
+    }
+    return cmd->histo;
+}
+
+static void report_perf(const perf_counts_t *start, const perf_counts_t *end)
+{
+    uint64_t cycles = end->cycles - start->cycles;
+    report_noreturn(1, "Perf: %lu cycles", (unsigned long) cycles);
+    if (end->instructions != PERF_MISSING) {
+        uint64_t insns = end->instructions - start->instructions;
+        report_noreturn(1, ", %lu instructions, IPC %.2f",
+                        (unsigned long) insns,
+                        cycles ? (double) insns / cycles : 0.0);
+    }
+    if (end->llc_misses != PERF_MISSING) {
+        uint64_t misses = end->llc_misses - start->llc_misses;
+        report_noreturn(1, ", %lu LLC misses", (unsigned long) misses);
+        if (end->llc_refs != PERF_MISSING) {
+            uint64_t refs = end->llc_refs - start->llc_refs;
+            report_noreturn(1, " (%.1f%% of %lu refs)",
+                            refs ? 100.0 * misses / refs : 0.0,
+                            (unsigned long) refs);
+        }
+    }
+    if (end->branch_misses != PERF_MISSING)
+        report_noreturn(1, ", %lu branch misses",
+                        (unsigned long) (end->branch_misses -
+                                         start->branch_misses));
+    report(1, "");
+}
+
+/* Execute a command whose entry next_cmd has been looked up already */
+static bool exec_cmd(cmd_element_t *next_cmd, int argc, char *argv[])
 {
-    if (argc == 0)
-        return true;
-    /* Try to find matching command */
-    cmd_element_t *next_cmd = cmd_list;
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
     if (next_cmd) {
+        for (int i = 0; i < cmd_hook_cnt; i++) {
+            if (before_hooks[i])
+                before_hooks[i](argc, argv, true);
+        }
+        /* The command may change the options, or free itself when quitting */
+        perf_counts_t counts_start, counts_end;
+        bool counted = perf && perf_read(&counts_start);
+        bool timed = histo;
+        struct timespec start, end;
+        if (timed)
+            clock_gettime(CLOCK_MONOTONIC_RAW, &start);
         ok = next_cmd->operation(argc, argv);
+        if (timed && !quit_flag) {
+            clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+            histo_record(cmd_histo(next_cmd),
+                         (end.tv_sec - start.tv_sec) * 1000000000LL +
+                             (end.tv_nsec - start.tv_nsec));
+        }
+        if (counted && !quit_flag && perf && perf_read(&counts_end))
+            report_perf(&counts_start, &counts_end);
+        for (int i = 0; i < cmd_hook_cnt; i++) {
+            if (after_hooks[i])
+                after_hooks[i](argc, argv, ok);
+        }
         if (!ok)
             record_error();
     } else {
@@ -223,20 +453,262 @@ static bool interpret_cmda(int argc, char *argv[])
     return ok;
 }
 
-/* Execute a command from a command line */
-static bool interpret_cmd(char *cmdline)
+static cmd_block_t *new_cmd_block(void)
+{
+    cmd_block_t *b = malloc_or_fail(sizeof(cmd_block_t), "new_cmd_block");
+    b->ops = NULL;
+    b->op_cnt = b->op_size = 0;
+    return b;
+}
+
+static void free_cmd_block(cmd_block_t *b)
+{
+    for (int i = 0; i < b->op_cnt; i++) {
+        block_op_t *bop = &b->ops[i];
+        for (int j = 0; j < bop->op.argc; j++)
+            free_string(bop->op.argv[j]);
+        free_array(bop->op.argv, bop->op.argc, sizeof(char *));
+        if (bop->sub_argv) {
+            free_array(bop->sub_argv, bop->op.argc, sizeof(char *));
+            free_block(bop->sub_buf, bop->sub_size);
+        }
+        if (bop->body)
+            free_cmd_block(bop->body);
+    }
+    if (b->ops)
+        free_array(b->ops, b->op_size, sizeof(block_op_t));
+    free_block(b, sizeof(cmd_block_t));
+}
+
+/* Append a copy of a command to block b */
+static block_op_t *add_block_op(cmd_block_t *b, int argc, char *argv[])
+{
+    if (b->op_cnt == b->op_size) {
+        int size = b->op_size ? 2 * b->op_size : 8;
+        block_op_t *ops =
+            calloc_or_fail(size, sizeof(block_op_t), "add_block_op");
+        if (b->ops) {
+            memcpy(ops, b->ops, b->op_cnt * sizeof(block_op_t));
+            free_array(b->ops, b->op_size, sizeof(block_op_t));
+        }
+        b->ops = ops;
+        b->op_size = size;
+    }
+
+    block_op_t *bop = &b->ops[b->op_cnt++];
+    size_t text_size = 0;
+    int dollars = 0;
+    bop->op.cmd = find_cmd(argv[0]);
+    bop->op.argc = argc;
+    bop->op.argv = calloc_or_fail(argc, sizeof(char *), "add_block_op");
+    bop->op.line = NULL;
+    for (int i = 0; i < argc; i++) {
+        bop->op.argv[i] = strsave_or_fail(argv[i], "add_block_op");
+        text_size += strlen(argv[i]) + 1;
+        for (const char *c = argv[i]; (c = strchr(c, '$')); c++)
+            dollars++;
+    }
+    bop->body = NULL;
+    bop->sub_argv = NULL;
+    bop->sub_buf = NULL;
+    bop->sub_size = 0;
+    if (dollars) {
+        /* A value takes at most 20 characters, the name at least one */
+        bop->sub_size = text_size + 20 * dollars;
+        bop->sub_argv = calloc_or_fail(argc, sizeof(char *), "add_block_op");
+        bop->sub_buf = malloc_or_fail(bop->sub_size, "add_block_op");
+    }
+    return bop;
+}
+
+/* Replace '$name' or '${name}' of loop variables in the arguments of bop */
+static char **subst_args(block_op_t *bop)
+{
+    char *dst = bop->sub_buf;
+    for (int i = 0; i < bop->op.argc; i++) {
+        const char *src = bop->op.argv[i];
+        bop->sub_argv[i] = dst;
+        while (*src) {
+            if (*src != '$') {
+                *dst++ = *src++;
+                continue;
+            }
+            bool braced = src[1] == '{';
+            const char *name = src + 1 + braced;
+            size_t len = 0;
+            while (isalnum((unsigned char) name[len]) || name[len] == '_')
+                len++;
+            int v = loop_var_cnt - 1;
+            while (v >= 0 && !(strncmp(loop_vars[v].name, name, len) == 0 &&
+                               loop_vars[v].name[len] == '\0'))
+                v--;
+            if (len == 0 || v < 0 || (braced && name[len] != '}')) {
+                *dst++ = *src++;
+                continue;
+            }
+            dst += sprintf(dst, "%ld", loop_vars[v].value);
+            src = name + len + braced;
+        }
+        *dst++ = '\0';
+    }
+    return bop->sub_argv;
+}
+
+/* Execute the commands of block b once */
+static bool run_block(cmd_block_t *b)
+{
+    bool ok = true;
+    for (int i = 0; i < b->op_cnt && !quit_flag; i++) {
+        block_op_t *bop = &b->ops[i];
+        char **argv = bop->sub_argv ? subst_args(bop) : bop->op.argv;
+        cur_block = bop->body;
+        ok = exec_cmd(bop->op.cmd, bop->op.argc, argv) && ok;
+        if (cur_block) {
+            report(1, "Command '%s' does not take a block", argv[0]);
+            record_error();
+            cur_block = NULL;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/* Hand the block following the current command over to it */
+static cmd_block_t *take_block(void)
+{
+    cmd_block_t *b = cur_block;
+    cur_block = NULL;
+    return b;
+}
+
+static bool block_error(const char *msg)
+{
+    report(1, "%s", msg);
+    if (block_root) {
+        free_cmd_block(block_root);
+        block_root = NULL;
+    }
+    block_depth = 0;
+    record_error();
+    return false;
+}
+
+/* Read a command of a block, or execute it outside of any block */
+static bool feed_cmd(int argc, char *argv[])
+{
+    if (block_depth == 0)
+        return exec_cmd(find_cmd(argv[0]), argc, argv);
+    /* Comments are shown when the block is read, not when it is executed */
+    if (strcmp(argv[0], "#"))
+        add_block_op(block_stack[block_depth - 1], argc, argv);
+    return true;
+}
+
+/* Only these commands take a block, elsewhere braces are plain arguments */
+static bool takes_block(const char *name)
+{
+    return !strcmp(name, "repeat") || !strcmp(name, "for");
+}
+
+/* Whether the i-th argument opens a block for the command starting at start */
+static bool is_block_open(int start, int i, char *argv[])
+{
+    return i > start && !strcmp(argv[i], "{") && takes_block(argv[start]);
+}
+
+/* Whether a command line opens a block */
+static bool opens_block(int argc, char *argv[])
+{
+    int start = 0;
+    for (int i = 0; i < argc; i++) {
+        if (!strcmp(argv[i], ";"))
+            start = i + 1;
+        else if (is_block_open(start, i, argv))
+            return true;
+    }
+    return false;
+}
+
+/* Read a command line taking part in a block.
+ * Commands are separated by ';' or line ends, 'repeat' or 'for' followed by
+ * '{' takes the commands up to the matching '}' as its block.  Once the
+ * outermost block is closed, its command is executed.
+ */
+static bool feed_block(int argc, char *argv[])
+{
+    bool ok = true;
+    int start = 0;
+    for (int i = 0; i < argc && !quit_flag; i++) {
+        const char *tok = argv[i];
+        bool opening = is_block_open(start, i, argv);
+        bool closing = block_depth > 0 && !strcmp(tok, "}");
+        if (strcmp(tok, ";") && !opening && !closing)
+            continue;
+
+        if (opening) {
+            if (block_depth == MAXBLOCK)
+                return block_error("Blocks nested too deeply");
+            if (block_depth == 0)
+                block_root = new_cmd_block();
+            cmd_block_t *parent =
+                block_depth ? block_stack[block_depth - 1] : block_root;
+            block_op_t *bop = add_block_op(parent, i - start, argv + start);
+            bop->body = new_cmd_block();
+            block_stack[block_depth++] = bop->body;
+        } else {
+            if (i > start)
+                ok = feed_cmd(i - start, argv + start) && ok;
+            if (closing && --block_depth == 0) {
+                cmd_block_t *root = block_root;
+                block_root = NULL;
+                ok = run_block(root) && ok;
+                free_cmd_block(root);
+            }
+        }
+        start = i + 1;
+    }
+    if (start < argc && !quit_flag)
+        ok = feed_cmd(argc - start, argv + start) && ok;
+    return ok;
+}
+
+/* Execute a command line, or read it into a block */
+static bool run_cmd(cmd_element_t *next_cmd, int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+
+    if (block_depth > 0)
+        return feed_block(argc, argv);
+    if (strcmp(argv[0], "#") && opens_block(argc, argv))
+        return feed_block(argc, argv);
+    return exec_cmd(next_cmd, argc, argv);
+}
+
+/* Execute a command that has already been split into arguments */
+bool interpret_cmda(int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+    /* Try to find matching command */
+    return run_cmd(find_cmd(argv[0]), argc, argv);
+}
+
+/* Execute a command from the first len characters of a command line */
+static bool interpret_line(const char *line, size_t len)
 {
     if (quit_flag)
         return false;
 
     int argc;
-    char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
+    char **argv = parse_args(line, len, &argc);
+    return interpret_cmda(argc, argv);
+}
 
-    return ok;
+/* Execute a command from a command line */
+static bool interpret_cmd(char *cmdline)
+{
+    return interpret_line(cmdline, strlen(cmdline));
 }
 
 /* Set function to be executed as part of program exit */
@@ -248,6 +720,16 @@ void add_quit_helper(cmd_func_t qf)
         report_event(MSG_FATAL, "Exceeded limit on quit helpers");
 }
 
+/* Set functions to be executed before and after each command */
+void add_cmd_hook(cmd_hook_t before, cmd_hook_t after)
+{
+    if (cmd_hook_cnt < MAXHOOK) {
+        before_hooks[cmd_hook_cnt] = before;
+        after_hooks[cmd_hook_cnt++] = after;
+    } else
+        report_event(MSG_FATAL, "Exceeded limit on command hooks");
+}
+
 /* Turn echoing on/off */
 void set_echo(bool on)
 {
@@ -402,6 +884,282 @@ static bool do_time(int argc, char *argv[])
     return ok;
 }
 
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile p of sorted samples */
+static int64_t percentile(const int64_t *sorted, int cnt, int p)
+{
+    int rank = ((int64_t) cnt * p + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/* Print command words as a JSON string */
+static void report_json_words(int argc, char *argv[])
+{
+    report_noreturn(1, "\"");
+    for (int i = 0; i < argc; i++) {
+        for (const char *c = argv[i]; *c; c++) {
+            if (*c == '"' || *c == '\\')
+                report_noreturn(1, "\\%c", *c);
+            else if ((unsigned char) *c < 0x20)
+                report_noreturn(1, "\\u%.4x", *c);
+            else
+                report_noreturn(1, "%c", *c);
+        }
+        report_noreturn(1, i + 1 < argc ? " " : "\"");
+    }
+}
+
+static bool do_bench(int argc, char *argv[])
+{
+    enum { BENCH_TEXT, BENCH_CSV, BENCH_JSON } format = BENCH_TEXT;
+    int runs = 0;
+    if (argc > 1 && !strcmp(argv[1], "--csv")) {
+        format = BENCH_CSV;
+        argc--, argv++;
+    } else if (argc > 1 && !strcmp(argv[1], "--json")) {
+        format = BENCH_JSON;
+        argc--, argv++;
+    }
+    if (argc < 3) {
+        report(1, "Use 'bench [--csv|--json] N cmd arg ...'");
+        return false;
+    }
+    if (!get_int(argv[1], &runs) || runs <= 0) {
+        report(1, "Invalid number of runs '%s'", argv[1]);
+        return false;
+    }
+    argc -= 2, argv += 2;
+
+    cmd_element_t *cmd = find_cmd(argv[0]);
+    if (!cmd) {
+        report(1, "Unknown command '%s'", argv[0]);
+        return false;
+    }
+
+    int64_t *ns = calloc_or_fail(runs, sizeof(int64_t), "do_bench");
+    int64_t *cycles = calloc_or_fail(runs, sizeof(int64_t), "do_bench");
+    int64_t total = 0;
+    int done = 0;
+    bool ok = true;
+    while (done < runs && !quit_flag) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+        int64_t c0 = cpucycles();
+        ok = run_cmd(cmd, argc, argv) && ok;
+        int64_t c1 = cpucycles();
+        clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+        ns[done] = (end.tv_sec - start.tv_sec) * 1000000000LL +
+                   (end.tv_nsec - start.tv_nsec);
+        cycles[done] = c1 - c0;
+        total += ns[done++];
+    }
+
+    if (done > 0) {
+        qsort(ns, done, sizeof(int64_t), cmp_int64);
+        qsort(cycles, done, sizeof(int64_t), cmp_int64);
+        double mean = (double) total / done;
+        double rate = total > 0 ? 1.0E9 * done / total : 0;
+        int64_t med = percentile(ns, done, 50), p99 = percentile(ns, done, 99);
+        int64_t med_cycles = percentile(cycles, done, 50);
+        switch (format) {
+        case BENCH_CSV:
+            report(1,
+                   "runs,min_ns,median_ns,p99_ns,max_ns,ns_per_op,ops_per_s,"
+                   "median_cycles");
+            report(1, "%d,%ld,%ld,%ld,%ld,%.1f,%.1f,%ld", done, (long) ns[0],
+                   (long) med, (long) p99, (long) ns[done - 1], mean, rate,
+                   (long) med_cycles);
+            break;
+        case BENCH_JSON:
+            report_noreturn(1, "{\"cmd\": ");
+            report_json_words(argc, argv);
+            report(1,
+                   ", \"runs\": %d, \"min_ns\": %ld, \"median_ns\": %ld, "
+                   "\"p99_ns\": %ld, \"max_ns\": %ld, \"ns_per_op\": %.1f, "
+                   "\"ops_per_s\": %.1f, \"median_cycles\": %ld}",
+                   done, (long) ns[0], (long) med, (long) p99,
+                   (long) ns[done - 1], mean, rate, (long) med_cycles);
+            break;
+        default:
+            report(1,
+                   "%d runs: min %ld ns, median %ld ns, "
+                   "p99 %ld ns, max %ld ns",
+                   done, (long) ns[0], (long) med, (long) p99,
+                   (long) ns[done - 1]);
+            report(1, "%.1f ns/op, %.1f ops/s, median %ld cycles", mean, rate,
+                   (long) med_cycles);
+        }
+    }
+
+    free_array(ns, runs, sizeof(int64_t));
+    free_array(cycles, runs, sizeof(int64_t));
+    return ok;
+}
+
+static bool histo_export(const char *fname)
+{
+    FILE *f = fopen(fname, "w");
+    if (!f) {
+        report(1, "Could not open histogram file '%s'", fname);
+        return false;
+    }
+    for (cmd_element_t *c = cmd_list; c; c = c->next) {
+        if (c->histo && c->histo->count)
+            histo_write(f, c->name, c->histo);
+    }
+    fclose(f);
+    return true;
+}
+
+static bool histo_import(const char *fname)
+{
+    FILE *f = fopen(fname, "r");
+    if (!f) {
+        report(1, "Could not open histogram file '%s'", fname);
+        return false;
+    }
+
+    histogram_t *h = malloc_or_fail(sizeof(histogram_t), "histo_import");
+    char *line = NULL;
+    size_t size = 0;
+    bool ok = true;
+    while (getline(&line, &size, f) > 0) {
+        char *name = histo_parse(line, h);
+        if (!name) {
+            report(1, "Malformed histogram in '%s'", fname);
+            ok = false;
+            break;
+        }
+        cmd_element_t *cmd = find_cmd(name);
+        if (cmd)
+            histo_merge(cmd_histo(cmd), h);
+        else
+            report(3, "Skipping histogram of unknown command '%s'", name);
+    }
+    free(line);
+    free_block(h, sizeof(histogram_t));
+    fclose(f);
+    return ok;
+}
+
+static void perf_setter(int oldval)
+{
+    if (perf && !oldval && !perf_open()) {
+        report(1, "Warning: Hardware counters unavailable: %s",
+               strerror(errno));
+        perf = 0;
+    } else if (!perf && oldval)
+        perf_close();
+}
+
+static bool do_histo(int argc, char *argv[])
+{
+    if (argc == 3 && !strcmp(argv[1], "export"))
+        return histo_export(argv[2]);
+    if (argc == 3 && !strcmp(argv[1], "merge"))
+        return histo_import(argv[2]);
+    if (argc == 2 && !strcmp(argv[1], "reset")) {
+        for (cmd_element_t *c = cmd_list; c; c = c->next) {
+            if (c->histo)
+                histo_reset(c->histo);
+        }
+        return true;
+    }
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "show"))) {
+        report(1, "Use 'histo [show|reset|export file|merge file]'");
+        return false;
+    }
+
+    report(1, "%-12s %10s %10s %10s %10s %10s %10s %10s %10s", "Latency(ns)",
+           "count", "min", "p50", "p90", "p99", "p99.9", "max", "mean");
+    for (cmd_element_t *c = cmd_list; c; c = c->next) {
+        histogram_t *h = c->histo;
+        if (!h || !h->count)
+            continue;
+        report(1,
+               "%-12s %10lu %10lu %10lu %10lu %10lu %10lu %10lu %10.0f",
+               c->name, (unsigned long) h->count, (unsigned long) h->min,
+               (unsigned long) histo_percentile(h, 50),
+               (unsigned long) histo_percentile(h, 90),
+               (unsigned long) histo_percentile(h, 99),
+               (unsigned long) histo_percentile(h, 99.9),
+               (unsigned long) h->max, (double) h->sum / h->count);
+    }
+    return true;
+}
+
+static bool do_repeat(int argc, char *argv[])
+{
+    cmd_block_t *body = take_block();
+    int cnt = 0;
+    if (argc != 2 || !body) {
+        report(1, "Use 'repeat N { cmd ; ... }'");
+        return false;
+    }
+    if (!get_int(argv[1], &cnt) || cnt < 0) {
+        report(1, "Invalid repeat count '%s'", argv[1]);
+        return false;
+    }
+
+    for (int i = 0; i < cnt && !quit_flag; i++)
+        run_block(body);
+    return true;
+}
+
+static bool do_for(int argc, char *argv[])
+{
+    cmd_block_t *body = take_block();
+    if (argc != 4 || strcmp(argv[2], "in") || !body) {
+        report(1, "Use 'for VAR in FIRST..LAST { cmd ; ... }'");
+        return false;
+    }
+
+    const char *name = argv[1];
+    bool valid = isalpha((unsigned char) name[0]) || name[0] == '_';
+    for (const char *c = name; *c; c++)
+        valid = valid && (isalnum((unsigned char) *c) || *c == '_');
+    if (!valid) {
+        report(1, "Invalid loop variable '%s'", name);
+        return false;
+    }
+    if (loop_var_cnt == MAXBLOCK) {
+        report(1, "Loops nested too deeply");
+        return false;
+    }
+
+    char *end;
+    long first = strtol(argv[3], &end, 0);
+    long last = 0;
+    bool range = end != argv[3] && end[0] == '.' && end[1] == '.';
+    if (range) {
+        char *last_str = end + 2;
+        last = strtol(last_str, &end, 0);
+        range = end != last_str && *end == '\0';
+    }
+    if (!range) {
+        report(1, "Invalid range '%s'", argv[3]);
+        return false;
+    }
+
+    /* Ranges are inclusive and may count down */
+    long step = first <= last ? 1 : -1;
+    int v = loop_var_cnt++;
+    loop_vars[v].name = name;
+    for (long i = first; !quit_flag; i += step) {
+        loop_vars[v].value = i;
+        run_block(body);
+        if (i == last)
+            break;
+    }
+    loop_var_cnt--;
+    return true;
+}
+
 static bool use_linenoise = true;
 static int web_fd = -1;
 
@@ -430,8 +1188,13 @@ void init_cmd(void)
 {
     cmd_list = NULL;
     param_list = NULL;
+    cmd_table = NULL;
+    cmd_table_size = 0;
+    cmd_cnt = 0;
     err_cnt = 0;
     quit_flag = false;
+    block_root = cur_block = NULL;
+    block_depth = loop_var_cnt = 0;
 
     ADD_COMMAND(help, "Show summary", "");
     ADD_COMMAND(option,
@@ -441,6 +1204,13 @@ void init_cmd(void)
     ADD_COMMAND(source, "Read commands from source file", "file");
     ADD_COMMAND(log, "Copy output to file", "file");
     ADD_COMMAND(time, "Time command execution", "cmd arg ...");
+    ADD_COMMAND(bench, "Time N executions of command",
+                "[--csv|--json] N cmd arg ...");
+    ADD_COMMAND(histo, "Show, reset, export or merge latency histograms",
+                "[show|reset|export file|merge file]");
+    ADD_COMMAND(repeat, "Execute block N times", "N { cmd ; ... }");
+    ADD_COMMAND(for, "Execute block for VAR from FIRST to LAST",
+                "VAR in FIRST..LAST { cmd ; ... }");
     ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
     add_cmd("#", do_comment_cmd, "Display comment", "...");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
@@ -448,12 +1218,96 @@ void init_cmd(void)
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
     add_param("entropy", &show_entropy, "Show/Hide Shannon entropy", NULL);
+    add_param("histo", &histo, "Record latency histograms of commands", NULL);
+    add_param("perf", &perf, "Report hardware counters of each command",
+              perf_setter);
 
     init_in();
     init_time(&last_time);
     first_time = last_time;
 }
 
+static void free_prog(cmd_prog_t *prog)
+{
+    free_array(prog->ops, prog->op_cnt, sizeof(cmd_op_t));
+    free_array(prog->args, prog->arg_cnt, sizeof(char *));
+    free_block(prog->text, prog->text_size);
+    free_block(prog, sizeof(cmd_prog_t));
+}
+
+/* Split the whole of a mapped file into commands and look each of them up,
+ * so that executing it costs no more parsing.
+ */
+static cmd_prog_t *compile_file(const char *src, size_t size)
+{
+    /* Each line is kept with a newline for echoing, then split into words */
+    size_t line_cnt = 0;
+    for (const char *p = src; (p = memchr(p, '\n', src + size - p)); p++)
+        line_cnt++;
+    if (src[size - 1] != '\n')
+        line_cnt++;
+
+    cmd_prog_t *prog = malloc_or_fail(sizeof(cmd_prog_t), "compile_file");
+    prog->op_cnt = line_cnt;
+    prog->ops = calloc_or_fail(line_cnt, sizeof(cmd_op_t), "compile_file");
+    prog->arg_cnt = (size + 1) / 2 + line_cnt;
+    prog->args = calloc_or_fail(prog->arg_cnt, sizeof(char *), "compile_file");
+    prog->text_size = 2 * size + 3 * line_cnt;
+    prog->text = malloc_or_fail(prog->text_size, "compile_file");
+    prog->pc = 0;
+
+    const char *line = src;
+    char *dst = prog->text;
+    char **argv = prog->args;
+    for (size_t i = 0; i < line_cnt; i++) {
+        const char *end = memchr(line, '\n', src + size - line);
+        size_t len = end ? (size_t) (end - line) : (size_t) (src + size - line);
+        cmd_op_t *op = &prog->ops[i];
+
+        op->line = dst;
+        memcpy(dst, line, len);
+        dst[len] = '\n';
+        dst[len + 1] = '\0';
+        dst += len + 2;
+
+        op->argv = argv;
+        op->argc = split_args(line, len, dst, argv);
+        op->cmd = op->argc ? find_cmd(argv[0]) : NULL;
+        dst += len + 1;
+        argv += op->argc;
+        line += len + 1;
+    }
+
+    return prog;
+}
+
+/* Map a regular file for reading lines without copying them.
+ * Small files are compiled at once and unmapped again.
+ */
+static void map_file(rio_t *rio)
+{
+    struct stat st;
+    if (fstat(rio->fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+        (uintmax_t) st.st_size > SIZE_MAX)
+        return;
+
+    size_t size = st.st_size;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, rio->fd, 0);
+    if (map == MAP_FAILED)
+        return;
+
+    if (size <= COMPILE_LIMIT) {
+        rio->prog = compile_file(map, size);
+        munmap(map, size);
+        return;
+    }
+
+    madvise(map, size, MADV_SEQUENTIAL);
+    rio->map = map;
+    rio->map_size = size;
+    rio->map_pos = 0;
+}
+
 /* Create new buffer for named file.
  * Name == NULL for stdin.
  * Return true if successful.
@@ -472,12 +1326,26 @@ static bool push_file(char *fname)
     rnew->fd = fd;
     rnew->count = 0;
     rnew->bufptr = rnew->buf;
+    rnew->map = NULL;
+    rnew->prog = NULL;
+    rnew->busy = rnew->popped = false;
+    if (fname)
+        map_file(rnew);
     rnew->prev = buf_stack;
     buf_stack = rnew;
 
     return true;
 }
 
+static void free_rio(rio_t *rio)
+{
+    if (rio->map)
+        munmap(rio->map, rio->map_size);
+    if (rio->prog)
+        free_prog(rio->prog);
+    free_block(rio, sizeof(rio_t));
+}
+
 /* Pop a file buffer from stack */
 static void pop_file(void)
 {
@@ -485,7 +1353,11 @@ static void pop_file(void)
         rio_t *rsave = buf_stack;
         buf_stack = rsave->prev;
         close(rsave->fd);
-        free_block(rsave, sizeof(rio_t));
+        /* Arguments of the running command live in the compiled file */
+        if (rsave->busy)
+            rsave->popped = true;
+        else
+            free_rio(rsave);
     }
 }
 
@@ -551,6 +1423,57 @@ static char *readline(void)
     return linebuf;
 }
 
+/* Execute the next command of a compiled file.
+ * When all commands have been executed, pop the file.
+ */
+static void run_compiled(void)
+{
+    rio_t *rio = buf_stack;
+    cmd_prog_t *prog = rio->prog;
+    if (prog->pc == prog->op_cnt) {
+        pop_file();
+        return;
+    }
+
+    cmd_op_t *op = &prog->ops[prog->pc++];
+    if (echo) {
+        report_noreturn(1, prompt);
+        report_noreturn(1, "%s", op->line);
+    }
+    if (quit_flag)
+        return;
+
+    rio->busy = true;
+    run_cmd(op->cmd, op->argc, op->argv);
+    rio->busy = false;
+    if (rio->popped)
+        free_rio(rio);
+}
+
+/* Execute the next line of a mapped file.
+ * Lines are scanned in place, so nothing is copied before parsing.
+ */
+static void run_mapped(void)
+{
+    rio_t *rio = buf_stack;
+    if (rio->map_pos == rio->map_size) {
+        pop_file();
+        return;
+    }
+
+    const char *line = rio->map + rio->map_pos;
+    size_t rest = rio->map_size - rio->map_pos;
+    const char *end = memchr(line, '\n', rest);
+    size_t len = end ? (size_t) (end - line) : rest;
+    rio->map_pos += end ? len + 1 : len;
+
+    if (echo) {
+        report_noreturn(1, prompt);
+        report_noreturn(1, "%.*s\n", (int) len, line);
+    }
+    interpret_line(line, len);
+}
+
 static bool cmd_done(void)
 {
     return !buf_stack || quit_flag;
@@ -565,7 +1488,6 @@ static bool cmd_done(void)
  * nfds should be set to the maximum file descriptor for network sockets.
  * If nfds == 0, this indicates that there is no pending network activity
  */
-int web_connfd;
 static int cmd_select(int nfds,
                       fd_set *readfds,
                       fd_set *writefds,
@@ -598,6 +1520,10 @@ static int cmd_select(int nfds,
                 interpret_cmd(cmdline);
             fflush(stdout);
             prompt_flag = true;
+        } else if (buf_stack->prog) {
+            run_compiled();
+        } else if (buf_stack->map) {
+            run_mapped();
         } else if (infd != STDIN_FILENO) {
             char *cmdline = readline();
             if (cmdline)
@@ -613,6 +1539,14 @@ bool finish_cmd(void)
     if (!quit_flag)
         ok = ok && do_quit(0, NULL);
     has_infile = false;
+
+    if (arg_buf)
+        free_block(arg_buf, arg_buf_size);
+    if (arg_vec)
+        free_array(arg_vec, arg_vec_size, sizeof(char *));
+    arg_buf = NULL;
+    arg_vec = NULL;
+    arg_buf_size = arg_vec_size = 0;
     return ok && err_cnt == 0;
 }
 
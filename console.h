@@ -24,6 +24,7 @@ typedef struct __cmd_element {
     cmd_func_t operation;
     char *summary;
     char *param;
+    struct __histogram *histo; /* Latencies, NULL until first recorded */
     struct __cmd_element *next;
 } cmd_element_t;
 
@@ -56,6 +57,17 @@ bool get_int(char *vname, int *loc);
 /* Add function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf);
 
+/* Optionally supply functions that get invoked around each command.
+ * ok is the result of the command, and always true before it runs.
+ */
+typedef void (*cmd_hook_t)(int argc, char *argv[], bool ok);
+
+/* Add functions to be executed before and after each command */
+void add_cmd_hook(cmd_hook_t before, cmd_hook_t after);
+
+/* Execute a command that has already been split into arguments */
+bool interpret_cmda(int argc, char *argv[]);
+
 /* Turn echoing on/off */
 void set_echo(bool on);
 
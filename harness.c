@@ -1,13 +1,20 @@
 /* Test support code */
 
+/* dladdr() is a GNU extension */
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "random.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -36,28 +43,87 @@
 typedef struct __block_element {
     struct __block_element *next, *prev;
     size_t payload_size;
-    size_t magic_header; /* Marker to see if block seems legitimate */
-    unsigned char payload[0];
+    struct __alloc_site *site; /* Allocating call site, NULL if unprofiled */
+    size_t magic_header;       /* Marker to see if block seems legitimate */
+    /* Aligned as malloc would align it, whatever the fields above add up to */
+    _Alignas(max_align_t) unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_element_t;
 
 static block_element_t *allocated = NULL;
 static size_t allocated_count = 0;
 
+/* Payload bytes of allocated blocks */
+static size_t allocated_bytes = 0;
+static size_t alloc_total = 0;
+static size_t free_total = 0;
+
+/* Allocation statistics of one call site, keyed by its return address */
+#define ALLOC_SITES 512 /* Must be a power of 2 */
+
+typedef struct __alloc_site {
+    const void *addr;  /* Return address of the allocating call */
+    size_t count;      /* Number of allocations */
+    size_t bytes;      /* Total bytes allocated */
+    size_t live_bytes; /* Bytes still allocated */
+    size_t peak_bytes; /* Maximum of live_bytes */
+} alloc_site_t;
+
+/* Open-addressed table, so recording stays cheap enough for perf traces */
+static alloc_site_t alloc_sites[ALLOC_SITES];
+static size_t alloc_sites_dropped = 0;
+
+/* Record allocations per call site */
+int alloc_profiling = 0;
+
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/* Deterministic failure of the n-th allocation in a sequence */
+int fail_nth = 0;
+static size_t alloc_attempts = 0;
+
+/* Failures draw from a stream of their own, so that the strings a seed
+ * produces do not depend on how often the tested code allocates
+ */
+static random_stream_t fail_stream = {.id = 1};
+
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
 static bool error_occurred = false;
 static char *error_message = "";
 
-static int time_limit = 1;
+/* CPU time allowed to each time limited operation, 0 for no limit */
+int timeout_ms = 1000;
 
 /* Data for managing exceptions */
-static jmp_buf env;
+static sigjmp_buf env;
 static volatile sig_atomic_t jmp_ready = false;
-static bool time_limited = false;
+static volatile sig_atomic_t time_limited = false;
+
+/* Time limits use a timer on the CPU time of the process that fires every
+ * TIMER_SLICES-th of the limit.  An operation still running at more than
+ * TIMER_SLICES firings in a row has exceeded it.  The timer is armed by the
+ * first limited operation and stays armed across later ones, so they make
+ * no system call, until it fires while none runs and disarms itself.
+ * Without such a timer, alarm() limits the wall-clock time of every
+ * operation instead.
+ */
+#define TIMER_SLICES 10
+
+static enum {
+    TIMER_UNSET,
+    TIMER_CPU,   /* Periodic timer on the CPU time */
+    TIMER_ALARM, /* No such timer, alarm() */
+} timer_mode = TIMER_UNSET;
+#ifdef __linux__
+static timer_t cpu_timer;
+#endif
+static volatile sig_atomic_t timer_armed_ms = 0; /* Limit armed for, or 0 */
+static volatile sig_atomic_t limit_seq = 0;      /* Limited operations run */
+static volatile sig_atomic_t seen_seq = 0;       /* Operation at last firing */
+static volatile sig_atomic_t seen_slices = 0;    /* Firings it has run for */
+static sigset_t setup_mask;
 
 /* For test_malloc and test_calloc */
 typedef enum {
@@ -71,10 +137,36 @@ typedef enum {
 /* Should this allocation fail? */
 static bool fail_allocation(void)
 {
-    double weight = (double) random() / RAND_MAX;
+    alloc_attempts++;
+    if (fail_nth > 0)
+        return alloc_attempts == (size_t) fail_nth;
+    if (fail_probability == 0)
+        return false;
+
+    /* 53 random bits make a uniform double in [0, 1) */
+    double weight = (random_stream_u64(&fail_stream) >> 11) * 0x1.0p-53;
     return (weight < 0.01 * fail_probability);
 }
 
+/* Find (or claim) the profile entry of call site addr */
+static alloc_site_t *find_site(const void *addr)
+{
+    uintptr_t key = (uintptr_t) addr;
+    /* Fibonacci hashing spreads nearby return addresses over the table */
+    size_t i = (size_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32);
+    for (size_t probe = 0; probe < ALLOC_SITES; probe++) {
+        alloc_site_t *site = &alloc_sites[(i + probe) & (ALLOC_SITES - 1)];
+        if (site->addr == addr)
+            return site;
+        if (!site->addr) {
+            site->addr = addr;
+            return site;
+        }
+    }
+    alloc_sites_dropped++;
+    return NULL;
+}
+
 /* Find header of block, given its payload.
  * Signal error if doesn't seem like legitimate block
  */
@@ -124,7 +216,7 @@ static size_t *find_footer(block_element_t *b)
     return p;
 }
 
-static void *alloc(alloc_t alloc_type, size_t size)
+static void *alloc(alloc_t alloc_type, size_t size, const void *caller)
 {
     if (noallocate_mode) {
         char *msg_alloc_forbidden[] = {
@@ -156,6 +248,15 @@ static void *alloc(alloc_t alloc_type, size_t size)
 
     new_block->magic_header = MAGICHEADER;
     new_block->payload_size = size;
+    new_block->site = alloc_profiling ? find_site(caller) : NULL;
+    if (new_block->site) {
+        alloc_site_t *site = new_block->site;
+        site->count++;
+        site->bytes += size;
+        site->live_bytes += size;
+        if (site->live_bytes > site->peak_bytes)
+            site->peak_bytes = site->live_bytes;
+    }
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
     memset(p, (alloc_type == TEST_CALLOC) ? 0 : FILLCHAR, size);
@@ -166,6 +267,9 @@ static void *alloc(alloc_t alloc_type, size_t size)
         allocated->prev = new_block;
     allocated = new_block;
     allocated_count++;
+    allocated_bytes += size;
+    mem_track_alloc(size);
+    alloc_total++;
 
     return p;
 }
@@ -174,7 +278,7 @@ static void *alloc(alloc_t alloc_type, size_t size)
 
 void *test_malloc(size_t size)
 {
-    return alloc(TEST_MALLOC, size);
+    return alloc(TEST_MALLOC, size, __builtin_return_address(0));
 }
 
 // cppcheck-suppress unusedFunction
@@ -185,7 +289,7 @@ void *test_calloc(size_t nelem, size_t elsize)
      */
     if (!nelem || !elsize || nelem > SIZE_MAX / elsize)
         return NULL;
-    return alloc(TEST_CALLOC, nelem * elsize);
+    return alloc(TEST_CALLOC, nelem * elsize, __builtin_return_address(0));
 }
 
 /*
@@ -194,14 +298,15 @@ void *test_calloc(size_t nelem, size_t elsize)
  */
 void *test_realloc(void *p, size_t new_size)
 {
+    const void *caller = __builtin_return_address(0);
     if (!p)
-        return alloc(TEST_REALLOC, new_size);
+        return alloc(TEST_REALLOC, new_size, caller);
 
     const block_element_t *b = find_header(p);
     if (b->payload_size >= new_size)
         return p;
 
-    void *new_ptr = alloc(TEST_REALLOC, new_size);
+    void *new_ptr = alloc(TEST_REALLOC, new_size, caller);
     if (!new_ptr)
         return NULL;
     memcpy(new_ptr, p, b->payload_size);
@@ -229,6 +334,8 @@ void test_free(void *p)
                      p);
         error_occurred = true;
     }
+    if (b->site)
+        b->site->live_bytes -= b->payload_size;
     b->magic_header = MAGICFREE;
     *find_footer(b) = MAGICFREE;
     memset(p, FILLCHAR, b->payload_size);
@@ -243,15 +350,19 @@ void test_free(void *p)
     if (bn)
         bn->prev = bp;
 
+    allocated_bytes -= b->payload_size;
+    mem_track_free(b->payload_size);
     free(b);
     allocated_count--;
+    free_total++;
 }
 
 // cppcheck-suppress unusedFunction
 char *test_strdup(const char *s)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    /* Bypass test_malloc so the caller of strdup is the recorded site */
+    void *new = alloc(TEST_MALLOC, len, __builtin_return_address(0));
     if (!new)
         return NULL;
 
@@ -263,14 +374,93 @@ size_t allocation_check(void)
     return allocated_count;
 }
 
+void harness_mem_stat(mem_stat_t *stat)
+{
+    stat->blocks = allocated_count;
+    stat->bytes = allocated_bytes;
+    stat->allocs = alloc_total;
+    stat->frees = free_total;
+}
+
+void alloc_sequence_reset(void)
+{
+    alloc_attempts = 0;
+}
+
+size_t alloc_sequence(void)
+{
+    return alloc_attempts;
+}
+
+/* Order profile entries by decreasing total bytes */
+static int cmp_site_bytes(const void *a, const void *b)
+{
+    const alloc_site_t *sa = *(alloc_site_t *const *) a;
+    const alloc_site_t *sb = *(alloc_site_t *const *) b;
+    return (sa->bytes < sb->bytes) - (sa->bytes > sb->bytes);
+}
+
+/* Show the allocation profile, heaviest call site first */
+void alloc_profile_report(void)
+{
+    alloc_site_t *sites[ALLOC_SITES];
+    size_t n = 0;
+    for (size_t i = 0; i < ALLOC_SITES; i++) {
+        if (alloc_sites[i].addr)
+            sites[n++] = &alloc_sites[i];
+    }
+    qsort(sites, n, sizeof(sites[0]), cmp_site_bytes);
+
+    report(1, "%-36s %10s %12s %12s %12s", "Call site", "Count", "Bytes",
+           "Live", "Peak");
+    for (size_t i = 0; i < n; i++) {
+        char name[64];
+        Dl_info info;
+        const alloc_site_t *site = sites[i];
+        if (!dladdr(site->addr, &info)) {
+            snprintf(name, sizeof(name), "%p", site->addr);
+        } else if (info.dli_sname) {
+            snprintf(name, sizeof(name), "%s+0x%lx", info.dli_sname,
+                     (unsigned long) ((uintptr_t) site->addr -
+                                      (uintptr_t) info.dli_saddr));
+        } else {
+            /* Static function: offset in the object, suitable for addr2line */
+            const char *base = strrchr(info.dli_fname, '/');
+            snprintf(name, sizeof(name), "%s+0x%lx",
+                     base ? base + 1 : info.dli_fname,
+                     (unsigned long) ((uintptr_t) site->addr -
+                                      (uintptr_t) info.dli_fbase));
+        }
+        report(1, "%-36s %10lu %12lu %12lu %12lu", name,
+               (unsigned long) site->count, (unsigned long) site->bytes,
+               (unsigned long) site->live_bytes,
+               (unsigned long) site->peak_bytes);
+    }
+    if (alloc_sites_dropped)
+        report(1, "Warning: %lu allocations from untracked call sites",
+               (unsigned long) alloc_sites_dropped);
+}
+
+/* Forget all recorded call sites */
+void alloc_profile_reset(void)
+{
+    /* Detach live blocks from the entries about to be cleared */
+    for (block_element_t *b = allocated; b; b = b->next)
+        b->site = NULL;
+    memset(alloc_sites, 0, sizeof(alloc_sites));
+    alloc_sites_dropped = 0;
+}
+
 /* Implementation of functions for testing */
 
-/* Set/unset cautious mode.
+/* Set/unset cautious mode, returning the previous mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
  */
-void set_cautious_mode(bool cautious)
+bool set_cautious_mode(bool cautious)
 {
+    bool prev = cautious_mode;
     cautious_mode = cautious;
+    return prev;
 }
 
 /* Set/unset restricted allocation mode.
@@ -289,18 +479,81 @@ bool error_check(void)
     return e;
 }
 
+/* Create the CPU-time timer, or fall back to alarm() */
+static void timer_init(void)
+{
+    /* Leaving a signal handler through siglongjmp keeps its signal blocked.
+     * The mask is saved once here and restored on the error path only.
+     */
+    sigprocmask(SIG_SETMASK, NULL, &setup_mask);
+    timer_mode = TIMER_ALARM;
+#ifdef __linux__
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = SIGALRM;
+    if (timer_create(CLOCK_PROCESS_CPUTIME_ID, &sev, &cpu_timer) == 0)
+        timer_mode = TIMER_CPU;
+#endif
+}
+
+/* Raise SIGALRM for a limit of ms milliseconds, or cancel it if ms is 0 */
+static void timer_arm(int ms)
+{
+#ifdef __linux__
+    if (timer_mode == TIMER_CPU) {
+        long long slice_ns = ms * 1000000LL / TIMER_SLICES;
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = slice_ns / 1000000000;
+        its.it_value.tv_nsec = slice_ns % 1000000000;
+        its.it_interval = its.it_value;
+        timer_settime(cpu_timer, 0, &its, NULL);
+        timer_armed_ms = ms;
+        return;
+    }
+#endif
+    alarm((ms + 999) / 1000);
+}
+
+/* Called on SIGALRM.  Return whether the time limit has been exceeded. */
+bool time_limit_exceeded(void)
+{
+    if (timer_mode != TIMER_CPU)
+        return time_limited;
+
+    if (!time_limited) {
+        timer_arm(0);
+        return false;
+    }
+    if (seen_seq != limit_seq) {
+        seen_seq = limit_seq;
+        seen_slices = 0;
+    }
+    return ++seen_slices > TIMER_SLICES;
+}
+
+void time_limit_reset(void)
+{
+    timer_mode = TIMER_UNSET;
+    timer_armed_ms = 0;
+}
+
 /* Prepare for a risky operation using setjmp.
  * Function returns true for initial return, false for error return
  */
 bool exception_setup(bool limit_time)
 {
-    if (sigsetjmp(env, 1)) {
+    if (timer_mode == TIMER_UNSET)
+        timer_init();
+
+    if (sigsetjmp(env, 0)) {
         /* Got here from longjmp */
         jmp_ready = false;
-        if (time_limited) {
-            alarm(0);
-            time_limited = false;
-        }
+        if (time_limited && timer_mode == TIMER_ALARM)
+            timer_arm(0);
+        time_limited = false;
+        sigprocmask(SIG_SETMASK, &setup_mask, NULL);
 
         if (error_message)
             report_event(MSG_ERROR, error_message);
@@ -310,9 +563,12 @@ bool exception_setup(bool limit_time)
 
     /* Got here from initial call */
     jmp_ready = true;
-    if (limit_time) {
-        alarm(time_limit);
+    if (limit_time && timeout_ms > 0) {
+        limit_seq++;
+        /* Set before checking the timer, which disarms while it is false */
         time_limited = true;
+        if (timer_mode == TIMER_ALARM || timer_armed_ms != timeout_ms)
+            timer_arm(timeout_ms);
     }
     return true;
 }
@@ -320,10 +576,9 @@ bool exception_setup(bool limit_time)
 /* Call once past risky code */
 void exception_cancel(void)
 {
-    if (time_limited) {
-        alarm(0);
-        time_limited = false;
-    }
+    if (time_limited && timer_mode == TIMER_ALARM)
+        timer_arm(0);
+    time_limited = false;
 
     jmp_ready = false;
     error_message = "";
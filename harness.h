@@ -18,17 +18,42 @@ char *test_strdup(const char *s);
 
 #ifdef INTERNAL
 
+#include "report.h"
+
 /* Report number of allocated blocks */
 size_t allocation_check(void);
 
+/* Get allocation counters of the tested program */
+void harness_mem_stat(mem_stat_t *stat);
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* When positive, fail exactly this allocation (1-based) of each sequence and
+ * ignore fail_probability
+ */
+extern int fail_nth;
+
+/* Restart counting allocations, as done at the start of every command */
+void alloc_sequence_reset(void);
+
+/* Number of allocations attempted since the last reset */
+size_t alloc_sequence(void);
+
+/* Record allocation statistics per call site when nonzero */
+extern int alloc_profiling;
+
+/* Show the per-call-site allocation profile, sorted by bytes */
+void alloc_profile_report(void);
+
+/* Clear the per-call-site allocation profile */
+void alloc_profile_reset(void);
+
 /*
- * Set/unset cautious mode.
+ * Set/unset cautious mode, returning the previous mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
  */
-void set_cautious_mode(bool cautious);
+bool set_cautious_mode(bool cautious);
 
 /*
  * Set/unset restricted allocation mode.
@@ -39,6 +64,15 @@ void set_noallocate_mode(bool noallocate);
 /* Return whether any errors have occurred since last time checked */
 bool error_check(void);
 
+/* CPU time in milliseconds allowed to operations limited by exception_setup */
+extern int timeout_ms;
+
+/* Called on SIGALRM.  Return whether the time limit has been exceeded. */
+bool time_limit_exceeded(void);
+
+/* Start the time limit timer anew, as needed in a forked child */
+void time_limit_reset(void);
+
 /* Prepare for a risky operation using setjmp.
  * Function returns true for initial return, false for error return
  */
@@ -0,0 +1,112 @@
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "histogram.h"
+
+static inline int histo_index(uint64_t v)
+{
+    if (v < HISTO_SUB)
+        return v;
+    int e = 63 - __builtin_clzll(v);
+    int shift = e - HISTO_SUB_BITS;
+    return (shift + 1) * HISTO_SUB + (int) (v >> shift) - HISTO_SUB;
+}
+
+/* Largest value counted in bucket i */
+static uint64_t histo_upper(int i)
+{
+    if (i < HISTO_SUB)
+        return i;
+    int shift = i / HISTO_SUB - 1;
+    uint64_t m = i % HISTO_SUB + HISTO_SUB;
+    return ((m + 1) << shift) - 1;
+}
+
+void histo_reset(histogram_t *h)
+{
+    memset(h, 0, sizeof(histogram_t));
+    h->min = UINT64_MAX;
+}
+
+void histo_record(histogram_t *h, uint64_t v)
+{
+    h->buckets[histo_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+}
+
+void histo_merge(histogram_t *dst, const histogram_t *src)
+{
+    for (int i = 0; i < HISTO_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+uint64_t histo_percentile(const histogram_t *h, double p)
+{
+    if (h->count == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t) (p / 100 * h->count + 0.5);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTO_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t v = histo_upper(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+void histo_write(FILE *f, const char *name, const histogram_t *h)
+{
+    fprintf(f, "%s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64, name,
+            h->count, h->sum, h->min, h->max);
+    for (int i = 0; i < HISTO_BUCKETS; i++) {
+        if (h->buckets[i])
+            fprintf(f, " %d:%" PRIu64, i, h->buckets[i]);
+    }
+    fputc('\n', f);
+}
+
+char *histo_parse(char *line, histogram_t *h)
+{
+    char *name = strtok(line, " \t\n");
+    char *field[4];
+    for (int i = 0; i < 4; i++) {
+        field[i] = strtok(NULL, " \t\n");
+        if (!name || !field[i])
+            return NULL;
+    }
+
+    histo_reset(h);
+    h->count = strtoull(field[0], NULL, 10);
+    h->sum = strtoull(field[1], NULL, 10);
+    h->min = strtoull(field[2], NULL, 10);
+    h->max = strtoull(field[3], NULL, 10);
+
+    uint64_t total = 0;
+    char *tok;
+    while ((tok = strtok(NULL, " \t\n"))) {
+        char *end;
+        long i = strtol(tok, &end, 10);
+        if (*end != ':' || i < 0 || i >= HISTO_BUCKETS)
+            return NULL;
+        h->buckets[i] = strtoull(end + 1, NULL, 10);
+        total += h->buckets[i];
+    }
+    return total == h->count ? name : NULL;
+}
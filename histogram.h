@@ -0,0 +1,45 @@
+#ifndef LAB0_HISTOGRAM_H
+#define LAB0_HISTOGRAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Log-linear histogram of latencies in nanoseconds.
+ * Values below HISTO_SUB are counted exactly.  Every larger power of two is
+ * split into HISTO_SUB linear buckets, so a value is known to within 1/32
+ * of itself, while recording takes constant time and memory is fixed.
+ */
+#define HISTO_SUB_BITS 5
+#define HISTO_SUB (1 << HISTO_SUB_BITS)
+#define HISTO_BUCKETS ((64 - HISTO_SUB_BITS + 1) * HISTO_SUB)
+
+typedef struct __histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[HISTO_BUCKETS];
+} histogram_t;
+
+/* Clear all samples */
+void histo_reset(histogram_t *h);
+
+/* Count value v */
+void histo_record(histogram_t *h, uint64_t v);
+
+/* Add all samples of src to dst */
+void histo_merge(histogram_t *dst, const histogram_t *src);
+
+/* Smallest value not exceeded by p percent of the samples */
+uint64_t histo_percentile(const histogram_t *h, double p);
+
+/* Write h as one line starting with name */
+void histo_write(FILE *f, const char *name, const histogram_t *h);
+
+/* Parse a line written by histo_write into h, cutting the name out of line.
+ * Return the name, or NULL if line is malformed.
+ */
+char *histo_parse(char *line, histogram_t *h);
+
+#endif /* LAB0_HISTOGRAM_H */
@@ -0,0 +1,123 @@
+#include <errno.h>
+#include <string.h>
+
+#include "perf.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define PERF_EVENTS 5
+
+/* Group members, in the order of the fields of perf_counts_t */
+static const uint64_t perf_configs[PERF_EVENTS] = {
+    PERF_COUNT_HW_CPU_CYCLES,       PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_REFERENCES, PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+static int perf_fds[PERF_EVENTS] = {-1, -1, -1, -1, -1};
+static int perf_slots[PERF_EVENTS]; /* Index in group read, -1 if missing */
+static int perf_nr = 0;
+
+static int perf_event_open(uint64_t config, int group_fd)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group_fd == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+bool perf_open(void)
+{
+    if (perf_fds[0] >= 0)
+        return true;
+
+    /* Cycles lead the group; other counters are optional */
+    perf_fds[0] = perf_event_open(perf_configs[0], -1);
+    if (perf_fds[0] < 0)
+        return false;
+    perf_slots[0] = 0;
+    perf_nr = 1;
+    for (int i = 1; i < PERF_EVENTS; i++) {
+        perf_fds[i] = perf_event_open(perf_configs[i], perf_fds[0]);
+        perf_slots[i] = perf_fds[i] >= 0 ? perf_nr++ : -1;
+    }
+
+    if (ioctl(perf_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP) < 0 ||
+        ioctl(perf_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) < 0) {
+        int err = errno;
+        perf_close();
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
+void perf_close(void)
+{
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        if (perf_fds[i] >= 0)
+            close(perf_fds[i]);
+        perf_fds[i] = -1;
+    }
+    perf_nr = 0;
+}
+
+bool perf_read(perf_counts_t *counts)
+{
+    uint64_t buf[3 + PERF_EVENTS];
+    if (perf_fds[0] < 0)
+        return false;
+    ssize_t len = (3 + perf_nr) * sizeof(uint64_t);
+    if (read(perf_fds[0], buf, len) != len || buf[0] != (uint64_t) perf_nr)
+        return false;
+
+    /* The group shared the counters with others when running < enabled */
+    uint64_t enabled = buf[1], running = buf[2];
+    if (running == 0)
+        return false;
+    uint64_t values[PERF_EVENTS];
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        if (perf_slots[i] < 0) {
+            values[i] = PERF_MISSING;
+            continue;
+        }
+        uint64_t v = buf[3 + perf_slots[i]];
+        values[i] = running == enabled
+                        ? v
+                        : (uint64_t) ((double) v * enabled / running);
+    }
+    counts->cycles = values[0];
+    counts->instructions = values[1];
+    counts->llc_refs = values[2];
+    counts->llc_misses = values[3];
+    counts->branch_misses = values[4];
+    return true;
+}
+
+#else
+
+bool perf_open(void)
+{
+    errno = ENOSYS;
+    return false;
+}
+
+void perf_close(void) {}
+
+bool perf_read(perf_counts_t *counts)
+{
+    return false;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,29 @@
+#ifndef LAB0_PERF_H
+#define LAB0_PERF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Hardware counters of this process, counted in user space only.
+ * Counters the CPU does not provide read as PERF_MISSING.
+ */
+#define PERF_MISSING UINT64_MAX
+
+typedef struct {
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t llc_refs;
+    uint64_t llc_misses;
+    uint64_t branch_misses;
+} perf_counts_t;
+
+/* Open and start the counter group.  Return false if unavailable. */
+bool perf_open(void);
+
+/* Stop and release the counter group */
+void perf_close(void);
+
+/* Read current counter values, scaled if the group was multiplexed */
+bool perf_read(perf_counts_t *counts);
+
+#endif /* LAB0_PERF_H */
@@ -0,0 +1,299 @@
+/* Make ucontext register names and dladdr available */
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <link.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "profile.h"
+
+/* Samples are stored as their depth followed by that many addresses,
+ * innermost first, in a ring written by the signal handler only and read
+ * by profile_dump only, so the two never need a lock.
+ */
+#define PROFILE_RING (1 << 20) /* Words, must be a power of two */
+#define PROFILE_DEPTH 64
+
+static uintptr_t ring[PROFILE_RING];
+static size_t ring_head = 0; /* Next word to write, owned by the handler */
+static size_t ring_tail = 0; /* Next word to read, owned by profile_dump */
+static volatile size_t ring_dropped = 0;
+
+static bool running = false;
+static uintptr_t stack_top = 0;
+static struct sigaction old_action;
+
+/* Highest address of the main thread stack, or 0 if unknown */
+static uintptr_t find_stack_top(void)
+{
+    FILE *f = fopen("/proc/self/maps", "r");
+    if (!f)
+        return 0;
+
+    char line[256];
+    uintptr_t top = 0;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long lo, hi;
+        if (strstr(line, "[stack]") && sscanf(line, "%lx-%lx", &lo, &hi) == 2)
+            top = hi;
+    }
+    fclose(f);
+    return top;
+}
+
+static void profile_handler(int sig, siginfo_t *si, void *context)
+{
+    ucontext_t *uc = context;
+    uintptr_t pc, sp, fp;
+#if defined(__x86_64__)
+    pc = uc->uc_mcontext.gregs[REG_RIP];
+    sp = uc->uc_mcontext.gregs[REG_RSP];
+    fp = uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+    pc = uc->uc_mcontext.pc;
+    sp = uc->uc_mcontext.sp;
+    fp = uc->uc_mcontext.regs[29];
+#else
+    return;
+#endif
+
+    size_t head = ring_head;
+    size_t tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+    if (PROFILE_RING - (head - tail) < PROFILE_DEPTH + 1) {
+        ring_dropped++;
+        return;
+    }
+
+    /* Frames lie between the interrupted stack pointer and the stack top.
+     * Each holds the caller's frame pointer followed by the return address.
+     */
+    size_t depth = 0;
+    ring[(head + 1) & (PROFILE_RING - 1)] = pc;
+    depth++;
+    while (depth < PROFILE_DEPTH && fp >= sp &&
+           fp + 2 * sizeof(uintptr_t) <= stack_top &&
+           !(fp & (sizeof(uintptr_t) - 1))) {
+        const uintptr_t *frame = (const uintptr_t *) fp;
+        if (!frame[1])
+            break;
+        /* Step back into the call instruction */
+        ring[(head + 1 + depth++) & (PROFILE_RING - 1)] = frame[1] - 1;
+        if (frame[0] <= fp)
+            break;
+        fp = frame[0];
+    }
+    ring[head & (PROFILE_RING - 1)] = depth;
+    __atomic_store_n(&ring_head, head + 1 + depth, __ATOMIC_RELEASE);
+}
+
+bool profile_start(int hz)
+{
+    if (running || hz <= 0 || hz > 1000000)
+        return false;
+
+    stack_top = find_stack_top();
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = profile_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, &old_action) < 0)
+        return false;
+
+    struct itimerval it;
+    it.it_interval.tv_sec = 1 / hz;
+    it.it_interval.tv_usec = (1000000 / hz) % 1000000;
+    it.it_value = it.it_interval;
+    if (setitimer(ITIMER_PROF, &it, NULL) < 0) {
+        sigaction(SIGPROF, &old_action, NULL);
+        return false;
+    }
+    running = true;
+    return true;
+}
+
+void profile_stop(void)
+{
+    if (!running)
+        return;
+
+    struct itimerval it;
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_PROF, &it, NULL);
+    sigaction(SIGPROF, &old_action, NULL);
+    running = false;
+}
+
+bool profile_running(void)
+{
+    return running;
+}
+
+/* Functions of the executable, including static ones, from its symtab */
+typedef struct {
+    uintptr_t addr;
+    size_t size;
+    const char *name;
+} prof_sym_t;
+
+static prof_sym_t *syms = NULL;
+static size_t sym_cnt = 0;
+static bool syms_loaded = false;
+
+static int cmp_sym(const void *a, const void *b)
+{
+    uintptr_t x = ((const prof_sym_t *) a)->addr;
+    uintptr_t y = ((const prof_sym_t *) b)->addr;
+    return (x > y) - (x < y);
+}
+
+/* Read the symbol table of the executable.
+ * Names point into its mapping, which is kept for the rest of the run.
+ */
+static void load_symbols(void)
+{
+    syms_loaded = true;
+    int fd = open("/proc/self/exe", O_RDONLY);
+    if (fd < 0)
+        return;
+    struct stat st;
+    char *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(ElfW(Ehdr)))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+
+    const ElfW(Ehdr) *eh = (const ElfW(Ehdr) *) map;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+        eh->e_shoff + (size_t) eh->e_shnum * sizeof(ElfW(Shdr)) >
+            (size_t) st.st_size) {
+        munmap(map, st.st_size);
+        return;
+    }
+
+    /* Position independent executables are relocated by their load base */
+    Dl_info info;
+    uintptr_t bias = 0;
+    if (eh->e_type == ET_DYN && dladdr((void *) load_symbols, &info))
+        bias = (uintptr_t) info.dli_fbase;
+
+    const ElfW(Shdr) *sh = (const ElfW(Shdr) *) (map + eh->e_shoff);
+    for (int i = 0; i < eh->e_shnum; i++) {
+        if (sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh->e_shnum)
+            continue;
+        const ElfW(Sym) *sym = (const ElfW(Sym) *) (map + sh[i].sh_offset);
+        size_t n = sh[i].sh_size / sizeof(ElfW(Sym));
+        const char *strtab = map + sh[sh[i].sh_link].sh_offset;
+        syms = malloc(n * sizeof(prof_sym_t));
+        if (!syms)
+            break;
+        for (size_t j = 0; j < n; j++) {
+            if (ELF64_ST_TYPE(sym[j].st_info) != STT_FUNC || !sym[j].st_value)
+                continue;
+            syms[sym_cnt].addr = sym[j].st_value + bias;
+            syms[sym_cnt].size = sym[j].st_size;
+            syms[sym_cnt++].name = strtab + sym[j].st_name;
+        }
+        qsort(syms, sym_cnt, sizeof(prof_sym_t), cmp_sym);
+        break;
+    }
+}
+
+/* Name the function containing pc */
+static const char *symbolize(uintptr_t pc, char *buf, size_t len)
+{
+    if (!syms_loaded)
+        load_symbols();
+
+    size_t lo = 0, hi = sym_cnt;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (syms[mid].addr <= pc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo > 0 && pc < syms[lo - 1].addr + syms[lo - 1].size)
+        return syms[lo - 1].name;
+
+    /* Otherwise name the symbol, or at least the library */
+    Dl_info info;
+    if (!dladdr((void *) pc, &info)) {
+        snprintf(buf, len, "0x%lx", (unsigned long) pc);
+        return buf;
+    }
+    if (info.dli_sname)
+        return info.dli_sname;
+    const char *lib = info.dli_fname ? strrchr(info.dli_fname, '/') : NULL;
+    snprintf(buf, len, "[%s]", lib ? lib + 1 : "unknown");
+    return buf;
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+long profile_dump(const char *fname, size_t *dropped)
+{
+    FILE *f = fopen(fname, "w");
+    if (!f)
+        return -1;
+
+    size_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    size_t tail = ring_tail;
+    size_t max_cnt = (head - tail) / 2 + 1;
+    char **stacks = malloc(max_cnt * sizeof(char *));
+    size_t cnt = 0;
+
+    /* Turn every sample into its folded stack, outermost frame first */
+    while (stacks && tail != head) {
+        size_t depth = ring[tail & (PROFILE_RING - 1)];
+        char names[PROFILE_DEPTH][32];
+        const char *frames[PROFILE_DEPTH];
+        size_t len = 0;
+        for (size_t i = 0; i < depth; i++) {
+            uintptr_t pc = ring[(tail + 1 + i) & (PROFILE_RING - 1)];
+            frames[i] = symbolize(pc, names[i], sizeof(names[i]));
+            len += strlen(frames[i]) + 1;
+        }
+        tail += 1 + depth;
+
+        char *s = malloc(len);
+        if (!s)
+            continue;
+        char *p = s;
+        for (size_t i = depth; i-- > 0;)
+            p += sprintf(p, "%s%s", frames[i], i ? ";" : "");
+        stacks[cnt++] = s;
+    }
+    __atomic_store_n(&ring_tail, head, __ATOMIC_RELEASE);
+
+    /* Merge identical stacks */
+    qsort(stacks, cnt, sizeof(char *), cmp_str);
+    for (size_t i = 0, j; i < cnt; i = j) {
+        for (j = i + 1; j < cnt && !strcmp(stacks[i], stacks[j]); j++)
+            free(stacks[j]);
+        fprintf(f, "%s %lu\n", stacks[i], (unsigned long) (j - i));
+        free(stacks[i]);
+    }
+    free(stacks);
+    fclose(f);
+
+    if (dropped)
+        *dropped = ring_dropped;
+    ring_dropped = 0;
+    return cnt;
+}
@@ -0,0 +1,28 @@
+#ifndef LAB0_PROFILE_H
+#define LAB0_PROFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Sampling profiler driven by SIGPROF.
+ * Every sample is the call stack found by walking frame pointers, so the
+ * program must be built with -fno-omit-frame-pointer.
+ */
+
+/* Start sampling hz times per second of CPU time */
+bool profile_start(int hz);
+
+/* Stop sampling, keeping the samples taken so far */
+void profile_stop(void);
+
+/* True while sampling */
+bool profile_running(void);
+
+/* Write and discard the samples taken so far as folded stacks, one line
+ * "outer;...;inner count" per distinct stack, as read by flamegraph.pl.
+ * Return the number of samples written, or -1 if fname cannot be written.
+ * The number of samples lost because the buffer was full goes to *dropped.
+ */
+long profile_dump(const char *fname, size_t *dropped);
+
+#endif /* LAB0_PROFILE_H */
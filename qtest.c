@@ -2,17 +2,26 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <math.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h> /* strcasecmp */
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #if defined(__APPLE__)
 #include <mach/mach_time.h>
 #else /* Assume POSIX environments */
@@ -45,6 +54,9 @@ extern int show_entropy;
 #include "queue.h"
 
 #include "console.h"
+#include "histogram.h"
+#include "profile.h"
+#include "record.h"
 #include "report.h"
 
 /* Settable parameters */
@@ -80,8 +92,18 @@ static int string_length = MAXSTRING;
 
 static int descend = 0;
 
+/* Seed of random strings and allocation failures, or 0 to use the OS */
+static int seed = 0;
+
+/* Operations at the ends of a queue fully check it every verify-th time and
+ * otherwise only check the nodes near its ends.  0 means never fully.
+ */
+static int verify = 1;
+static int verify_count = 0;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
+#define RANDSTR_BATCH 256 /* Random strings generated at once */
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
 /* For queue_insert and queue_remove */
 typedef enum {
@@ -90,6 +112,10 @@ typedef enum {
 } position_t;
 /* Forward declarations */
 static bool q_show(int vlevel);
+static bool q_show_ends(int vlevel);
+static bool q_quit(int argc, char *argv[]);
+static bool record_strings(void);
+static void record_insert(position_t pos, char *s, bool ok);
 
 static bool do_free(int argc, char *argv[])
 {
@@ -106,8 +132,9 @@ static bool do_free(int argc, char *argv[])
     }
     error_check();
 
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
+    bool cautious = set_cautious_mode(false);
+    if (!current || current->size <= BIG_LIST_SIZE)
+        set_cautious_mode(cautious);
 
     struct list_head *qnext = NULL;
     if (chain.size > 1) {
@@ -121,8 +148,8 @@ static bool do_free(int argc, char *argv[])
         if (exception_setup(true))
             q_free(current->q);
         exception_cancel();
-        set_cautious_mode(true);
     }
+    set_cautious_mode(cautious);
 
     if (current) {
         free(current);
@@ -178,21 +205,226 @@ static bool do_new(int argc, char *argv[])
     return ok && !error_check();
 }
 
-/* TODO: Add a buf_size check of if the buf_size may be less
- * than MIN_RANDSTR_LEN.
+/* Fill cnt consecutive strings of MAX_RANDSTR_LEN bytes each with random
+ * strings of MIN_RANDSTR_LEN to MAX_RANDSTR_LEN - 1 characters.  Every value
+ * is picked as (r * range) >> 16 from a random 16-bit r, which is unbiased
+ * enough without division or rejection and maps to SIMD multiplies.
  */
-static void fill_rand_string(char *buf, size_t buf_size)
+static void fill_rand_strings(char *buf, size_t cnt)
 {
-    size_t len = 0;
-    while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
+    uint16_t rnd[RANDSTR_BATCH * (MAX_RANDSTR_LEN + 1)];
+    while (cnt > 0) {
+        size_t n = cnt < RANDSTR_BATCH ? cnt : RANDSTR_BATCH;
+        size_t chars = n * MAX_RANDSTR_LEN;
+        const uint16_t *lens = rnd + chars;
+        randombytes((uint8_t *) rnd, (chars + n) * sizeof(uint16_t));
+
+        size_t i = 0;
+#ifdef __SSE2__
+        /* The characters of charset are consecutive */
+        const __m128i range = _mm_set1_epi16(sizeof(charset) - 1);
+        const __m128i first = _mm_set1_epi8(charset[0]);
+        for (; i + 16 <= chars; i += 16) {
+            __m128i lo = _mm_loadu_si128((const __m128i *) (rnd + i));
+            __m128i hi = _mm_loadu_si128((const __m128i *) (rnd + i + 8));
+            lo = _mm_mulhi_epu16(lo, range);
+            hi = _mm_mulhi_epu16(hi, range);
+            _mm_storeu_si128((__m128i *) (buf + i),
+                             _mm_add_epi8(_mm_packus_epi16(lo, hi), first));
+        }
+#endif
+        for (; i < chars; i++)
+            buf[i] = charset[(rnd[i] * (sizeof(charset) - 1)) >> 16];
+
+        for (i = 0; i < n; i++) {
+            size_t len =
+                MIN_RANDSTR_LEN +
+                ((lens[i] * (MAX_RANDSTR_LEN - MIN_RANDSTR_LEN)) >> 16);
+            buf[i * MAX_RANDSTR_LEN + len] = '\0';
+        }
+        buf += chars;
+        cnt -= n;
+    }
+}
+
+/* Structured inputs of 'ih/it -g KIND [param] [n]', reproducible under
+ * 'option seed'.  The n strings follow each other along the queue in the
+ * generated order, whichever end they are inserted at.
+ */
+typedef enum {
+    GEN_SORTED,
+    GEN_REVSORTED,
+    GEN_NEARLYSORTED, /* Sorted but param percent of keys anywhere */
+    GEN_ZIPF,         /* Ranks drawn with weight 1 / rank^param */
+    GEN_FEWUNIQUE,    /* param distinct keys */
+    GEN_PREFIX,       /* Random strings after a shared param-long prefix */
+} gen_kind_t;
+
+static const struct {
+    const char *name;
+    gen_kind_t kind;
+    bool has_param;
+} generators[] = {
+    {"SORTED", GEN_SORTED, false},
+    {"REVSORTED", GEN_REVSORTED, false},
+    {"NEARLYSORTED", GEN_NEARLYSORTED, true},
+    {"ZIPF", GEN_ZIPF, true},
+    {"FEWUNIQUE", GEN_FEWUNIQUE, true},
+    {"PREFIX", GEN_PREFIX, true},
+};
+
+#define GEN_KEY_LEN 8
+#define GEN_KEY_SPACE 208827064576ULL /* 26^GEN_KEY_LEN */
+#define ZIPF_MAX_RANKS (1 << 20)
+#define PREFIX_MAX_LEN 1000
 
-    uint64_t randstr_buf_64[MAX_RANDSTR_LEN] = {0};
-    randombytes((uint8_t *) randstr_buf_64, len * sizeof(uint64_t));
-    for (size_t n = 0; n < len; n++)
-        buf[n] = charset[randstr_buf_64[n] % (sizeof(charset) - 1)];
+typedef struct {
+    gen_kind_t kind;
+    double param;
+    uint64_t base, step; /* Sorted keys are base, base + step, ... */
+    uint64_t salt;       /* Scatters ranks over the key space */
+    double *cdf;         /* Cumulative weights of Zipf ranks */
+    size_t ranks;
+    char *prefix; /* Shared prefix followed by room for a random suffix */
+    size_t prefix_len;
+    char key[GEN_KEY_LEN + 1];
+    random_stream_t rng; /* Private, so draws do not depend on queue.c */
+} gen_t;
+
+static inline uint64_t gen_rand(gen_t *g)
+{
+    return random_stream_u64(&g->rng);
+}
 
-    buf[len] = '\0';
+/* Write x as GEN_KEY_LEN letters, so that keys sort as their values */
+static char *gen_key_of(gen_t *g, uint64_t x)
+{
+    x %= GEN_KEY_SPACE;
+    for (int i = GEN_KEY_LEN - 1; i >= 0; i--) {
+        g->key[i] = charset[x % (sizeof(charset) - 1)];
+        x /= sizeof(charset) - 1;
+    }
+    g->key[GEN_KEY_LEN] = '\0';
+    return g->key;
+}
+
+static bool gen_init(gen_t *g, gen_kind_t kind, const char *param, int n)
+{
+    memset(g, 0, sizeof(gen_t));
+    g->kind = kind;
+    if (param) {
+        char *end;
+        g->param = strtod(param, &end);
+        if (*end != '\0' || !isfinite(g->param)) {
+            report(1, "Invalid generator parameter '%s'", param);
+            return false;
+        }
+    }
+    random_stream_init(&g->rng, random_u64());
+    g->base = gen_rand(g) % (GEN_KEY_SPACE / 2);
+    g->step = 1 + gen_rand(g) % 16;
+    g->salt = gen_rand(g);
+
+    switch (kind) {
+    case GEN_NEARLYSORTED:
+        if (g->param < 0 || g->param > 100) {
+            report(1, "Percentage of unsorted keys must be within 0..100");
+            return false;
+        }
+        break;
+    case GEN_ZIPF:
+        if (g->param <= 0) {
+            report(1, "Zipf exponent must be positive");
+            return false;
+        }
+        g->ranks = n < ZIPF_MAX_RANKS ? n : ZIPF_MAX_RANKS;
+        g->cdf = malloc(g->ranks * sizeof(double));
+        if (!g->cdf) {
+            report(1, "Could not allocate Zipf distribution of %zu ranks",
+                   g->ranks);
+            return false;
+        }
+        double sum = 0;
+        for (size_t k = 0; k < g->ranks; k++)
+            g->cdf[k] = sum += pow(k + 1, -g->param);
+        break;
+    case GEN_FEWUNIQUE:
+        if (g->param < 1) {
+            report(1, "Number of distinct keys must be positive");
+            return false;
+        }
+        /* More keys than the key space holds would be no different */
+        if (g->param > GEN_KEY_SPACE)
+            g->param = GEN_KEY_SPACE;
+        break;
+    case GEN_PREFIX:
+        if (g->param < 0 || g->param > PREFIX_MAX_LEN) {
+            report(1, "Prefix length must be within 0..%d", PREFIX_MAX_LEN);
+            return false;
+        }
+        g->prefix_len = g->param;
+        g->prefix = malloc(g->prefix_len + MAX_RANDSTR_LEN);
+        if (!g->prefix) {
+            report(1, "Could not allocate prefix");
+            return false;
+        }
+        for (size_t i = 0; i < g->prefix_len; i++)
+            g->prefix[i] = charset[gen_rand(g) % (sizeof(charset) - 1)];
+        break;
+    default:
+        break;
+    }
+    return true;
+}
+
+static void gen_free(gen_t *g)
+{
+    free(g->cdf);
+    free(g->prefix);
+    g->cdf = NULL;
+    g->prefix = NULL;
+}
+
+/* Return the i-th of n strings, valid until the next call */
+static char *gen_next(gen_t *g, size_t i, size_t n)
+{
+    switch (g->kind) {
+    case GEN_SORTED:
+        return gen_key_of(g, g->base + i * g->step);
+    case GEN_REVSORTED:
+        return gen_key_of(g, g->base + (n - 1 - i) * g->step);
+    case GEN_NEARLYSORTED:
+        if (gen_rand(g) % 10000 < g->param * 100)
+            i = gen_rand(g) % n;
+        return gen_key_of(g, g->base + i * g->step);
+    case GEN_ZIPF: {
+        double u = (gen_rand(g) >> 11) * 0x1.0p-53 * g->cdf[g->ranks - 1];
+        size_t lo = 0, hi = g->ranks - 1;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (g->cdf[mid] > u)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        return gen_key_of(g, random_shuffle(lo + g->salt));
+    }
+    case GEN_FEWUNIQUE:
+        return gen_key_of(
+            g, random_shuffle(gen_rand(g) % (uint64_t) g->param + g->salt));
+    case GEN_PREFIX: {
+        /* One draw holds the length and all letters of the suffix */
+        char *suffix = g->prefix + g->prefix_len;
+        uint64_t r = gen_rand(g);
+        size_t len = MIN_RANDSTR_LEN + r % (MAX_RANDSTR_LEN - MIN_RANDSTR_LEN);
+        r /= MAX_RANDSTR_LEN - MIN_RANDSTR_LEN;
+        for (size_t k = 0; k < len; k++, r /= sizeof(charset) - 1)
+            suffix[k] = charset[r % (sizeof(charset) - 1)];
+        suffix[len] = '\0';
+        return g->prefix;
+    }
+    }
+    return NULL;
 }
 
 /* insertion */
@@ -215,25 +447,52 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
     }
 
     char *lasts = NULL;
-    char randstr_buf[MAX_RANDSTR_LEN];
+    char randstr_buf[RANDSTR_BATCH][MAX_RANDSTR_LEN];
     int reps = 1;
     bool ok = true, need_rand = false;
-    if (argc != 2 && argc != 3) {
-        report(1, "%s needs 1-2 arguments", argv[0]);
+    char *inserts = argv[1];
+    int gen_idx = -1;
+    if (argc > 2 && !strcmp(argv[1], "-g")) {
+        const size_t gen_cnt = sizeof(generators) / sizeof(generators[0]);
+        for (size_t i = 0; i < gen_cnt; i++) {
+            if (!strcmp(argv[2], generators[i].name))
+                gen_idx = i;
+        }
+        if (gen_idx < 0) {
+            report(1, "Unknown generator '%s'", argv[2]);
+            return false;
+        }
+    }
+
+    /* Arguments before the count */
+    int nargs = 1;
+    if (gen_idx >= 0)
+        nargs = generators[gen_idx].has_param ? 3 : 2;
+    if (argc != nargs + 1 && argc != nargs + 2) {
+        report(1, "%s needs %d-%d arguments", argv[0], nargs, nargs + 1);
         return false;
     }
 
-    char *inserts = argv[1];
-    if (argc == 3) {
-        if (!get_int(argv[2], &reps) || reps < 1)
+    if (argc == nargs + 2) {
+        if (!get_int(argv[nargs + 1], &reps) || reps < 1)
             return false;
     }
 
+    gen_t gen;
+    if (gen_idx >= 0 && !gen_init(&gen, generators[gen_idx].kind,
+                                  nargs == 3 ? argv[3] : NULL, reps)) {
+        gen_free(&gen);
+        return false;
+    }
+
     if (!strcmp(inserts, "RAND")) {
         need_rand = true;
-        inserts = randstr_buf;
+        inserts = randstr_buf[0];
     }
 
+    /* Log what was inserted, as replay would not generate the same */
+    bool log_strings = (need_rand || gen_idx >= 0) && record_strings();
+
     if (!current || !current->q)
         report(3, "Warning: Calling insert %s on null queue",
                pos == POS_TAIL ? "tail" : "head");
@@ -241,8 +500,18 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
 
     if (current && exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
-            if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
+            if (need_rand) {
+                int i = r % RANDSTR_BATCH;
+                if (i == 0) {
+                    int cnt = reps - r < RANDSTR_BATCH ? reps - r
+                                                       : RANDSTR_BATCH;
+                    fill_rand_strings(randstr_buf[0], cnt);
+                }
+                inserts = randstr_buf[i];
+            } else if (gen_idx >= 0) {
+                inserts =
+                    gen_next(&gen, pos == POS_TAIL ? r : reps - 1 - r, reps);
+            }
             bool rval = pos == POS_TAIL ? q_insert_tail(current->q, inserts)
                                         : q_insert_head(current->q, inserts);
             if (rval) {
@@ -280,11 +549,16 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                 }
             }
             ok = ok && !error_check();
+            if (log_strings)
+                record_insert(pos, inserts, ok);
         }
     }
     exception_cancel();
 
-    q_show(3);
+    if (gen_idx >= 0)
+        gen_free(&gen);
+
+    q_show_ends(3);
     return ok;
 }
 
@@ -410,7 +684,7 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
         ok = false;
     }
 
-    q_show(3);
+    q_show_ends(3);
 
     free(removes);
     free(checks);
@@ -427,6 +701,25 @@ static inline bool do_rt(int argc, char *argv[])
     return queue_remove(POS_TAIL, argc, argv);
 }
 
+/* Fingerprint of an element taken before q_delete_dup */
+typedef struct {
+    uint64_t hash;
+    uint32_t len;
+    bool dup;   /* Equal to a neighbour, so expected to be deleted */
+    size_t off; /* Copy of the string in the buffer of all of them */
+} dedup_print_t;
+
+/* FNV-1a hash of a string, also returning its length */
+static uint64_t str_fingerprint(const char *s, uint32_t *len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const char *p = s;
+    for (; *p; p++)
+        h = (h ^ (unsigned char) *p) * 0x100000001b3ULL;
+    *len = p - s;
+    return h;
+}
+
 static bool do_dedup(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -439,72 +732,97 @@ static bool do_dedup(int argc, char *argv[])
         return false;
     }
 
-    LIST_HEAD(l_copy);
-    element_t *item = NULL, *tmp = NULL;
-
-    // Copy current->q to l_copy
-    if (current->q && !list_empty(current->q)) {
-        list_for_each_entry(item, current->q, list) {
-            size_t slen;
-            tmp = malloc(sizeof(element_t));
-            if (!tmp)
-                break;
-            INIT_LIST_HEAD(&tmp->list);
-            slen = strlen(item->value) + 1;
-            tmp->value = malloc(slen);
-            if (!tmp->value) {
-                free(tmp);
+    /* Fingerprint every element rather than copying the queue, and keep the
+     * strings side by side in a single buffer, one copy for a run of equal
+     * ones.  Strings are compared with strcmp wherever fingerprints match.
+     */
+    size_t cnt = 0, prints_size = current->size > 0 ? current->size : 1;
+    size_t texts_len = 0, texts_size = prints_size * 16;
+    dedup_print_t *prints = malloc(prints_size * sizeof(dedup_print_t));
+    char *texts = malloc(texts_size);
+    element_t *item;
+    list_for_each_entry(item, current->q, list) {
+        if (!prints || !texts)
+            break;
+        if (cnt == prints_size) {
+            prints_size *= 2;
+            dedup_print_t *p =
+                realloc(prints, prints_size * sizeof(dedup_print_t));
+            if (!p) {
+                free(prints);
+                prints = NULL;
                 break;
             }
-            memcpy(tmp->value, item->value, slen);
-            list_add_tail(&tmp->list, &l_copy);
+            prints = p;
         }
-        // Return false if the loop does not leave properly
-        if (&item->list != current->q) {
-            list_for_each_entry_safe(item, tmp, &l_copy, list) {
-                free(item->value);
-                free(item);
+        dedup_print_t *d = &prints[cnt];
+        d->hash = str_fingerprint(item->value, &d->len);
+        d->dup = cnt > 0 && d->hash == d[-1].hash && d->len == d[-1].len &&
+                 !strcmp(item->value, texts + d[-1].off);
+        if (d->dup) {
+            d[-1].dup = true;
+            d->off = d[-1].off;
+        } else {
+            if (texts_len + d->len + 1 > texts_size) {
+                while (texts_len + d->len + 1 > texts_size)
+                    texts_size *= 2;
+                char *t = realloc(texts, texts_size);
+                if (!t) {
+                    free(texts);
+                    texts = NULL;
+                    break;
+                }
+                texts = t;
             }
-            report(1,
-                   "INTERNAL ERROR.  Could not allocate space for "
-                   "duplicate checking");
-            return false;
+            d->off = texts_len;
+            memcpy(texts + texts_len, item->value, d->len + 1);
+            texts_len += d->len + 1;
         }
+        cnt++;
+    }
+    if (!prints || !texts) {
+        free(prints);
+        free(texts);
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for "
+               "duplicate checking");
+        return false;
     }
 
+    /* Checking every free against all blocks would make it quadratic */
+    bool cautious = set_cautious_mode(false);
+    if (current->size <= BIG_LIST_SIZE)
+        set_cautious_mode(cautious);
+
     bool ok = true;
     if (exception_setup(true))
         ok = q_delete_dup(current->q);
     exception_cancel();
+    set_cautious_mode(cautious);
 
     if (!ok) {
-        list_for_each_entry_safe(item, tmp, &l_copy, list) {
-            free(item->value);
-            free(item);
-        }
+        free(prints);
+        free(texts);
         report(1, "ERROR: Calling delete duplicate on null queue");
         return false;
     }
 
+    /* Distinct strings must remain in their order, and nothing else */
     struct list_head *l_tmp = current->q->next;
-    bool is_this_dup = false;
-    // Compare between new list and old one
-    list_for_each_entry(item, &l_copy, list) {
-        // Skip comparison with new list if the string is duplicate
-        bool is_next_dup =
-            item->list.next != &l_copy &&
-            strcmp(list_entry(item->list.next, element_t, list)->value,
-                   item->value) == 0;
-        if (is_this_dup || is_next_dup) {
-            // Update list size
+    for (size_t i = 0; i < cnt; i++) {
+        if (prints[i].dup) {
             current->size--;
-        } else if (l_tmp != current->q &&
-                   strcmp(list_entry(l_tmp, element_t, list)->value,
-                          item->value) == 0)
+            continue;
+        }
+        const char *s =
+            l_tmp != current->q ? list_entry(l_tmp, element_t, list)->value
+                                : NULL;
+        uint32_t len;
+        if (s && str_fingerprint(s, &len) == prints[i].hash &&
+            len == prints[i].len && !strcmp(s, texts + prints[i].off))
             l_tmp = l_tmp->next;
         else
             ok = false;
-        is_this_dup = is_next_dup;
     }
     // All elements in new list should be traversed
     ok = ok && l_tmp == current->q;
@@ -513,10 +831,8 @@ static bool do_dedup(int argc, char *argv[])
                "ERROR: Duplicate strings are in queue or distinct strings are "
                "not in queue");
 
-    list_for_each_entry_safe(item, tmp, &l_copy, list) {
-        free(item->value);
-        free(item);
-    }
+    free(prints);
+    free(texts);
 
     q_show(3);
     return ok && !error_check();
@@ -598,6 +914,29 @@ static bool do_size(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Original position of a node, to check the stability of sort */
+typedef struct {
+    struct list_head *node;
+    size_t rank;
+} node_rank_t;
+
+static int cmp_node_rank(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t) ((const node_rank_t *) a)->node;
+    uintptr_t y = (uintptr_t) ((const node_rank_t *) b)->node;
+    return (x > y) - (x < y);
+}
+
+static size_t node_rank(const node_rank_t *ranks,
+                        size_t cnt,
+                        struct list_head *node)
+{
+    node_rank_t key = {.node = node};
+    const node_rank_t *r =
+        bsearch(&key, ranks, cnt, sizeof(node_rank_t), cmp_node_rank);
+    return r ? r->rank : 0;
+}
+
 bool do_sort(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -616,24 +955,30 @@ bool do_sort(int argc, char *argv[])
         report(3, "Warning: Calling sort on single node");
     error_check();
 
-    set_noallocate_mode(true);
-
-/* If the number of elements is too large, it may take a long time to check the
- * stability of the sort. So, MAX_NODES is used to limit the number of elements
- * to check the stability of the sort. */
-#define MAX_NODES 100000
-    struct list_head *nodes[MAX_NODES];
-    unsigned no = 0;
-    if (current && current->size && current->size <= MAX_NODES) {
-        element_t *entry;
-        list_for_each_entry(entry, current->q, list)
-            nodes[no++] = &entry->list;
-    } else if (current && current->size > MAX_NODES)
-        report(1,
-               "Warning: Skip checking the stability of the sort because the "
-               "number of elements %d is too large, exceeds the limit %d.",
-               current->size, MAX_NODES);
+    /* Remember the original rank of every node, sorted by node address so
+     * that ranks are found by binary search once sorted.
+     */
+    node_rank_t *ranks = NULL;
+    size_t rank_cnt = 0;
+    if (cnt > 1) {
+        ranks = malloc(cnt * sizeof(node_rank_t));
+        if (ranks) {
+            struct list_head *node;
+            list_for_each (node, current->q) {
+                if (rank_cnt == (size_t) cnt)
+                    break;
+                ranks[rank_cnt].node = node;
+                ranks[rank_cnt].rank = rank_cnt;
+                rank_cnt++;
+            }
+            qsort(ranks, rank_cnt, sizeof(node_rank_t), cmp_node_rank);
+        } else
+            report(1,
+                   "Warning: Skip checking the stability of the sort, out of "
+                   "memory");
+    }
 
+    set_noallocate_mode(true);
     if (current && exception_setup(true))
         q_sort(current->q, descend);
     exception_cancel();
@@ -659,18 +1004,9 @@ bool do_sort(int argc, char *argv[])
                 break;
             }
             /* Ensure the stability of the sort */
-            if (current->size <= MAX_NODES &&
-                !strcmp(item->value, next_item->value)) {
-                bool unstable = false;
-                for (unsigned i = 0; i < MAX_NODES; i++) {
-                    if (nodes[i] == cur_l->next) {
-                        unstable = true;
-                        break;
-                    }
-                    if (nodes[i] == cur_l)
-                        break;
-                }
-                if (unstable) {
+            if (ranks && !strcmp(item->value, next_item->value)) {
+                if (node_rank(ranks, rank_cnt, cur_l->next) <
+                    node_rank(ranks, rank_cnt, cur_l)) {
                     report(
                         1,
                         "ERROR: Not stable sort. The duplicate strings \"%s\" "
@@ -682,7 +1018,7 @@ bool do_sort(int argc, char *argv[])
             }
         }
     }
-#undef MAX_NODES
+    free(ranks);
 
     q_show(3);
     return ok && !error_check();
@@ -956,7 +1292,29 @@ static bool is_circular(void)
     return true;
 }
 
-static bool q_show(int vlevel)
+/* Check the links of the nodes near both ends only */
+static bool is_circular_ends(void)
+{
+    struct list_head *cur = current->q;
+    for (int i = 0; i < BIG_LIST_SIZE; i++) {
+        if (!cur->next || cur->next->prev != cur)
+            return false;
+        cur = cur->next;
+        if (cur == current->q)
+            return true;
+    }
+
+    cur = current->q;
+    for (int i = 0; i < BIG_LIST_SIZE; i++) {
+        if (!cur->prev || cur->prev->next != cur)
+            return false;
+        cur = cur->prev;
+    }
+    return true;
+}
+
+/* Show the queue, checking all of it if full or only its ends otherwise */
+static bool show_queue(int vlevel, bool full)
 {
     bool ok = true;
     if (verblevel < vlevel)
@@ -968,7 +1326,7 @@ static bool q_show(int vlevel)
         return true;
     }
 
-    if (!is_circular()) {
+    if (full ? !is_circular() : !is_circular_ends()) {
         report(vlevel, "ERROR:  Queue is not doubly circular");
         return false;
     }
@@ -979,7 +1337,8 @@ static bool q_show(int vlevel)
     struct list_head *cur = current->q->next;
 
     if (exception_setup(true)) {
-        while (ok && ori != cur && cnt < current->size) {
+        int limit = full ? current->size : BIG_LIST_SIZE;
+        while (ok && ori != cur && cnt < limit) {
             element_t *e = list_entry(cur, element_t, list);
             if (cnt < BIG_LIST_SIZE) {
                 report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
@@ -1006,6 +1365,8 @@ static bool q_show(int vlevel)
             report(vlevel, "]");
         else
             report(vlevel, " ... ]");
+    } else if (!full) {
+        report(vlevel, " ... ]");
     } else {
         report(vlevel, " ... ]");
         report(vlevel, "ERROR:  Queue has more than %d elements",
@@ -1016,6 +1377,25 @@ static bool q_show(int vlevel)
     return ok;
 }
 
+static bool q_show(int vlevel)
+{
+    return show_queue(vlevel, true);
+}
+
+/* Show the queue after an operation that only touched its ends */
+static bool q_show_ends(int vlevel)
+{
+    if (verblevel < vlevel)
+        return true;
+
+    bool full = current && current->size <= 2 * BIG_LIST_SIZE;
+    if (verify > 0 && ++verify_count >= verify) {
+        verify_count = 0;
+        full = true;
+    }
+    return show_queue(vlevel, full);
+}
+
 static bool do_show(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -1075,6 +1455,1272 @@ static bool do_next(int argc, char *argv[])
     return q_show(0);
 }
 
+/* Empirical complexity: time an operation on private queues of doubling
+ * sizes and pick the growth model that explains the timings best.
+ */
+#define COMPLEXITY_MIN_N 128
+#define COMPLEXITY_MAX_N 4096
+#define COMPLEXITY_REPS 7
+#define COMPLEXITY_BATCH 256 /* Most constant time operations per timing */
+#define COMPLEXITY_STOP_NS 250000000.0 /* Stop growing beyond 0.25 s */
+#define COMPLEXITY_MODELS 5
+
+typedef struct {
+    const char *name;
+    /* Operate cnt times on a queue, or once if undo is NULL */
+    void (*run)(struct list_head *q, int cnt);
+    /* Restore the queue size after run, untimed */
+    void (*undo)(struct list_head *q, int cnt);
+} cx_op_t;
+
+static void cx_ih(struct list_head *q, int cnt)
+{
+    for (int i = 0; i < cnt; i++)
+        q_insert_head(q, "complexity");
+}
+
+static void cx_it(struct list_head *q, int cnt)
+{
+    for (int i = 0; i < cnt; i++)
+        q_insert_tail(q, "complexity");
+}
+
+static void cx_rh(struct list_head *q, int cnt)
+{
+    for (int i = 0; i < cnt; i++) {
+        element_t *e = q_remove_head(q, NULL, 0);
+        if (e)
+            q_release_element(e);
+    }
+}
+
+static void cx_rt(struct list_head *q, int cnt)
+{
+    for (int i = 0; i < cnt; i++) {
+        element_t *e = q_remove_tail(q, NULL, 0);
+        if (e)
+            q_release_element(e);
+    }
+}
+
+static void cx_size(struct list_head *q, int cnt)
+{
+    q_size(q);
+}
+
+static void cx_reverse(struct list_head *q, int cnt)
+{
+    q_reverse(q);
+}
+
+static void cx_reverseK(struct list_head *q, int cnt)
+{
+    q_reverseK(q, 3);
+}
+
+static void cx_swap(struct list_head *q, int cnt)
+{
+    q_swap(q);
+}
+
+static void cx_sort(struct list_head *q, int cnt)
+{
+    q_sort(q, descend);
+}
+
+static void cx_dedup(struct list_head *q, int cnt)
+{
+    q_delete_dup(q);
+}
+
+static void cx_dm(struct list_head *q, int cnt)
+{
+    q_delete_mid(q);
+}
+
+static void cx_ascend(struct list_head *q, int cnt)
+{
+    q_ascend(q);
+}
+
+static void cx_descend(struct list_head *q, int cnt)
+{
+    q_descend(q);
+}
+
+/* Merge is timed on its own chain of two sorted halves */
+static const cx_op_t cx_ops[] = {
+    {"ih", cx_ih, cx_rh},
+    {"it", cx_it, cx_rt},
+    {"rh", cx_rh, cx_ih},
+    {"rt", cx_rt, cx_it},
+    {"size", cx_size, NULL},
+    {"reverse", cx_reverse, NULL},
+    {"reverseK", cx_reverseK, NULL},
+    {"swap", cx_swap, NULL},
+    {"sort", cx_sort, NULL},
+    {"dedup", cx_dedup, NULL},
+    {"dm", cx_dm, NULL},
+    {"ascend", cx_ascend, NULL},
+    {"descend", cx_descend, NULL},
+    {"merge", NULL, NULL},
+};
+
+static const char *cx_model_names[COMPLEXITY_MODELS] = {
+    "O(1)", "O(log n)", "O(n)", "O(n log n)", "O(n^2)",
+};
+
+static double cx_model(int m, double n)
+{
+    switch (m) {
+    case 0:
+        return 1;
+    case 1:
+        return log2(n);
+    case 2:
+        return n;
+    case 3:
+        return n * log2(n);
+    default:
+        return n * n;
+    }
+}
+
+static struct list_head *cx_build(int n)
+{
+    char buf[RANDSTR_BATCH][MAX_RANDSTR_LEN];
+    struct list_head *q = q_new();
+    for (int i = 0; q && i < n; i++) {
+        if (i % RANDSTR_BATCH == 0) {
+            int cnt = n - i < RANDSTR_BATCH ? n - i : RANDSTR_BATCH;
+            fill_rand_strings(buf[0], cnt);
+        }
+        q_insert_tail(q, buf[i % RANDSTR_BATCH]);
+    }
+    return q;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double cx_elapsed(const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+/* Median time in nanoseconds of one operation at size n, or -1 if the
+ * operation raised an error or exceeded the time limit.
+ */
+static double cx_measure(const cx_op_t *op, int n)
+{
+    double samples[COMPLEXITY_REPS];
+    struct list_head *q = NULL, *q2 = NULL;
+    bool failed = false;
+    /* Keep the size within n +- n/4 while a batch runs */
+    int batch = n / 4 < COMPLEXITY_BATCH ? n / 4 : COMPLEXITY_BATCH;
+
+    for (int r = 0; r < COMPLEXITY_REPS && !failed; r++) {
+        struct timespec start;
+        if (!q || !op->undo)
+            q = cx_build(op->run ? n : n / 2);
+        if (!op->run) {
+            q2 = cx_build(n - n / 2);
+            q_sort(q, descend);
+            q_sort(q2, descend);
+        }
+        if (!q || (!op->run && !q2)) {
+            report(1, "ERROR: Cannot build queue of %d elements", n);
+            failed = true;
+            break;
+        }
+
+        if (exception_setup(true)) {
+            if (op->undo) {
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                op->run(q, batch);
+                samples[r] = cx_elapsed(&start) / batch;
+                /* Every repetition starts from exactly n elements */
+                int size = q_size(q);
+                op->undo(q, size > n ? size - n : n - size);
+            } else if (op->run) {
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                op->run(q, 1);
+                samples[r] = cx_elapsed(&start);
+            } else {
+                queue_contex_t ctx[2] = {{.q = q, .size = n / 2},
+                                         {.q = q2, .size = n - n / 2}};
+                struct list_head head;
+                INIT_LIST_HEAD(&head);
+                list_add_tail(&ctx[0].chain, &head);
+                list_add_tail(&ctx[1].chain, &head);
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                q_merge(&head, descend);
+                samples[r] = cx_elapsed(&start);
+            }
+        } else
+            failed = true;
+        exception_cancel();
+
+        if (exception_setup(true)) {
+            if (!op->undo || failed) {
+                q_free(q);
+                q = NULL;
+            }
+            if (q2) {
+                q_free(q2);
+                q2 = NULL;
+            }
+        }
+        exception_cancel();
+    }
+
+    if (q && exception_setup(true))
+        q_free(q);
+    exception_cancel();
+
+    if (failed)
+        return -1;
+    qsort(samples, COMPLEXITY_REPS, sizeof(double), cmp_double);
+    return samples[COMPLEXITY_REPS / 2];
+}
+
+static bool do_complexity(int argc, char *argv[])
+{
+    int max_n = COMPLEXITY_MAX_N;
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs an operation and an optional maximum size",
+               argv[0]);
+        return false;
+    }
+    if (argc == 3 &&
+        (!get_int(argv[2], &max_n) || max_n < 8 * COMPLEXITY_MIN_N)) {
+        report(1, "Maximum size must be at least %d", 8 * COMPLEXITY_MIN_N);
+        return false;
+    }
+
+    const cx_op_t *op = NULL;
+    for (size_t i = 0; i < sizeof(cx_ops) / sizeof(cx_ops[0]); i++) {
+        if (!strcmp(argv[1], cx_ops[i].name))
+            op = &cx_ops[i];
+    }
+    if (!op) {
+        report_noreturn(1, "Unknown operation '%s', use one of", argv[1]);
+        for (size_t i = 0; i < sizeof(cx_ops) / sizeof(cx_ops[0]); i++)
+            report_noreturn(1, " %s", cx_ops[i].name);
+        report(1, "");
+        return false;
+    }
+
+    double ns[32], sizes[32];
+    int cnt = 0;
+    report(1, "%10s %14s", "n", "ns/op");
+    /* Checking every free against all blocks would make freeing quadratic */
+    bool cautious = set_cautious_mode(false);
+    for (int n = COMPLEXITY_MIN_N; n <= max_n && cnt < 32; n *= 2) {
+        double t = cx_measure(op, n);
+        if (t < 0) {
+            report(1, "Stopped at n = %d", n);
+            break;
+        }
+        /* Keep the fits below defined for operations faster than the clock */
+        sizes[cnt] = n;
+        ns[cnt++] = t > 1 ? t : 1;
+        report(1, "%10d %14.1f", n, t);
+        if (t > COMPLEXITY_STOP_NS)
+            break;
+    }
+    set_cautious_mode(cautious);
+    if (cnt < 4) {
+        report(1, "ERROR: Need at least 4 sizes to classify, got %d", cnt);
+        return false;
+    }
+
+    /* Slope of log time against log size */
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (int i = 0; i < cnt; i++) {
+        double x = log(sizes[i]), y = log(ns[i]);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+    double slope = (cnt * sxy - sx * sy) / (cnt * sxx - sx * sx);
+
+    /* Fit t = c * f(n) minimizing the relative error of every size */
+    double err[COMPLEXITY_MODELS];
+    int best = 0, second = -1;
+    for (int m = 0; m < COMPLEXITY_MODELS; m++) {
+        double num = 0, den = 0;
+        for (int i = 0; i < cnt; i++) {
+            double f = cx_model(m, sizes[i]) / ns[i];
+            num += f;
+            den += f * f;
+        }
+        double c = num / den, sq = 0;
+        for (int i = 0; i < cnt; i++) {
+            double d = c * cx_model(m, sizes[i]) / ns[i] - 1;
+            sq += d * d;
+        }
+        err[m] = sqrt(sq / cnt);
+        if (err[m] < err[best]) {
+            second = best;
+            best = m;
+        } else if (m > 0 && (second < 0 || err[m] < err[second]))
+            second = m;
+    }
+
+    /* Confident when the runner-up explains the timings much worse */
+    double confidence = err[second] > 0 ? 1 - err[best] / err[second] : 0;
+    report(1, "Log-log slope %.2f", slope);
+    report(1, "%s: best fit %s (error %.1f%%), confidence %.0f%% over %s "
+              "(error %.1f%%)",
+           op->name, cx_model_names[best], 100 * err[best], 100 * confidence,
+           cx_model_names[second], 100 * err[second]);
+    return true;
+}
+
+static bool do_allocprof(int argc, char *argv[])
+{
+    if (argc == 2 && !strcmp(argv[1], "reset")) {
+        alloc_profile_reset();
+        return true;
+    }
+
+    if (argc != 1) {
+        report(1, "%s takes no arguments or 'reset'", argv[0]);
+        return false;
+    }
+
+    if (!alloc_profiling)
+        report(1, "Warning: Profiling is off. Use 'option allocprof 1'");
+    alloc_profile_report();
+    return true;
+}
+
+/* Samples per second of CPU time, prime to avoid beating with periodic work */
+#define PROFILE_HZ 997
+
+static bool do_profile(int argc, char *argv[])
+{
+    if (argc >= 2 && argc <= 3 && !strcmp(argv[1], "start")) {
+        int hz = PROFILE_HZ;
+        if (argc == 3 && (!get_int(argv[2], &hz) || hz <= 0)) {
+            report(1, "Invalid sampling rate '%s'", argv[2]);
+            return false;
+        }
+        if (!profile_start(hz)) {
+            report(1, profile_running() ? "Profiler is already running"
+                                        : "Cannot start profiler");
+            return false;
+        }
+        return true;
+    }
+
+    if (argc == 2 && !strcmp(argv[1], "stop")) {
+        profile_stop();
+        return true;
+    }
+
+    if (argc == 3 && !strcmp(argv[1], "dump")) {
+        size_t dropped;
+        long cnt = profile_dump(argv[2], &dropped);
+        if (cnt < 0) {
+            report(1, "Could not open profile file '%s'", argv[2]);
+            return false;
+        }
+        report(1, "Wrote %ld samples to '%s'", cnt, argv[2]);
+        if (dropped)
+            report(1, "Warning: %lu samples lost to a full buffer",
+                   (unsigned long) dropped);
+        return true;
+    }
+
+    report(1, "Use 'profile start [hz]|stop|dump file'");
+    return false;
+}
+
+/* Commands logged by 'record', numbered by their position */
+static const char *record_ops[] = {
+    "new",      "free",     "ih",       "it",       "rh",       "rt",
+    "size",     "swap",     "reverse",  "reverseK", "sort",     "dedup",
+    "dm",       "ascend",   "descend",  "merge",    "prev",     "next",
+    "option",
+};
+#define RECORD_OPS (sizeof(record_ops) / sizeof(record_ops[0]))
+
+#define REPLAY_BUF (1 << 16) /* Room for the arguments of one operation */
+#define REPLAY_MISMATCHES 5  /* Mismatches reported in detail */
+
+/* Commands run by 'replay' are in the log already */
+static bool replaying = false;
+
+/* Set once the strings of an ih/it command are logged one by one */
+static bool record_expanded = false;
+
+/* Fingerprints of the end strings, for callers within exception_setup */
+static void queue_ends(record_result_t *res)
+{
+    res->head = res->tail = 0;
+    if (!current || !current->q || list_empty(current->q))
+        return;
+
+    uint32_t len;
+    element_t *head = list_first_entry(current->q, element_t, list);
+    element_t *tail = list_last_entry(current->q, element_t, list);
+    res->head = str_fingerprint(head->value, &len);
+    res->tail = str_fingerprint(tail->value, &len);
+}
+
+/* Outcome of an operation, compared by 'replay' */
+static void queue_result(record_result_t *res, bool ok)
+{
+    res->ok = ok;
+    res->size = current ? current->size : -1;
+    res->head = res->tail = 0;
+    if (exception_setup(false))
+        queue_ends(res);
+    exception_cancel();
+}
+
+static bool record_strings(void)
+{
+    return record_active() && !replaying;
+}
+
+/* Opcode of command name, or RECORD_OPS if it is not logged */
+static unsigned record_opcode(const char *name)
+{
+    unsigned op = 0;
+    while (op < RECORD_OPS && strcmp(name, record_ops[op]))
+        op++;
+    return op;
+}
+
+/* Log a string inserted by 'ih/it RAND' or 'ih/it -g' as an insertion of
+ * its own, so that replay inserts it no matter how random strings come out
+ */
+static void record_insert(position_t pos, char *s, bool ok)
+{
+    record_result_t res = {
+        .ok = ok,
+        .size = current->size,
+    };
+    queue_ends(&res);
+    record_write(record_opcode(pos == POS_TAIL ? "it" : "ih"), 1, &s, &res);
+    record_expanded = true;
+}
+
+static void record_op(int argc, char *argv[], bool ok)
+{
+    bool expanded = record_expanded;
+    record_expanded = false;
+    if (!record_active() || replaying || expanded)
+        return;
+    unsigned op = record_opcode(argv[0]);
+    if (op < RECORD_OPS) {
+        record_result_t res;
+        queue_result(&res, ok);
+        record_write(op, argc - 1, argv + 1, &res);
+    }
+}
+
+static bool do_record(int argc, char *argv[])
+{
+    if (argc == 1) {
+        record_close();
+        return true;
+    }
+    if (argc != 2) {
+        report(1, "%s takes a file name, or none to stop", argv[0]);
+        return false;
+    }
+    if (!record_open(argv[1])) {
+        report(1, "Could not open recording '%s'", argv[1]);
+        return false;
+    }
+    return true;
+}
+
+static bool do_replay(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs a file name", argv[0]);
+        return false;
+    }
+
+    record_reader_t reader;
+    if (!record_reader_open(&reader, argv[1])) {
+        report(1, "Could not read recording '%s'", argv[1]);
+        return false;
+    }
+
+    histogram_t *histos[RECORD_OPS] = {NULL};
+    char *buf = malloc(REPLAY_BUF);
+    size_t cnt = 0, mismatches = 0;
+    struct timespec start, end;
+    int rc = 1;
+    replaying = true;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (buf) {
+        unsigned op;
+        int nargs;
+        char *op_argv[RECORD_MAX_ARGS + 1];
+        record_result_t expect, got;
+        rc = record_read(&reader, &op, &nargs, op_argv + 1, buf, REPLAY_BUF,
+                         &expect);
+        if (rc > 0 && op >= RECORD_OPS)
+            rc = -1;
+        if (rc <= 0)
+            break;
+
+        /* The arguments are already split, so skip the console parser */
+        op_argv[0] = (char *) record_ops[op];
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        bool ok = interpret_cmda(nargs + 1, op_argv);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        cnt++;
+
+        if (!histos[op] && (histos[op] = malloc(sizeof(histogram_t))))
+            histo_reset(histos[op]);
+        if (histos[op])
+            histo_record(histos[op], (t1.tv_sec - t0.tv_sec) * 1000000000LL +
+                                         (t1.tv_nsec - t0.tv_nsec));
+
+        queue_result(&got, ok);
+        if (got.ok != expect.ok || got.size != expect.size ||
+            got.head != expect.head || got.tail != expect.tail) {
+            if (mismatches++ < REPLAY_MISMATCHES)
+                report(1,
+                       "Mismatch at operation %lu (%s): ok %d/%d, size %d/%d, "
+                       "head and tail %s",
+                       (unsigned long) cnt, record_ops[op], got.ok, expect.ok,
+                       got.size, expect.size,
+                       got.head == expect.head && got.tail == expect.tail
+                           ? "match"
+                           : "differ");
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    replaying = false;
+    record_reader_close(&reader);
+
+    if (!buf)
+        report(1, "Could not allocate replay buffer");
+    else if (rc < 0)
+        report(1, "Recording '%s' is corrupt after %lu operations", argv[1],
+               (unsigned long) cnt);
+
+    double secs =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    report(1, "Replayed %lu operations in %.3f s (%.0f ops/s), %lu mismatches",
+           (unsigned long) cnt, secs, secs > 0 ? cnt / secs : 0,
+           (unsigned long) mismatches);
+    report(1, "%-12s %10s %10s %10s %10s %10s %10s", "Latency(ns)", "count",
+           "min", "p50", "p99", "max", "mean");
+    for (unsigned op = 0; op < RECORD_OPS; op++) {
+        histogram_t *h = histos[op];
+        if (!h)
+            continue;
+        report(1, "%-12s %10lu %10lu %10lu %10lu %10lu %10.0f",
+               record_ops[op], (unsigned long) h->count,
+               (unsigned long) h->min, (unsigned long) histo_percentile(h, 50),
+               (unsigned long) histo_percentile(h, 99), (unsigned long) h->max,
+               (double) h->sum / h->count);
+        free(h);
+    }
+    bool ok = buf && rc == 0 && !mismatches;
+    free(buf);
+    return ok;
+}
+
+#define LOAD_CHUNK 4096 /* Insertions per time limit when loading files */
+
+/* Snapshot of all queues written by 'save', in the byte order of the host:
+ * the header, the element count of every queue, the offset of every string
+ * in the blob, and the blob of NUL-terminated strings.
+ */
+#define SNAPSHOT_MAGIC "QSNAP\1\0"
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+typedef struct {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t queues;
+    uint64_t elements;
+    uint64_t blob_size;
+} snapshot_header_t;
+
+static bool save_queues(FILE *f)
+{
+    snapshot_header_t h = {.magic = SNAPSHOT_MAGIC,
+                           .byte_order = SNAPSHOT_BYTE_ORDER};
+    queue_contex_t *qctx;
+    element_t *e;
+    list_for_each_entry(qctx, &chain.head, chain) {
+        h.queues++;
+        if (!qctx->q)
+            continue;
+        list_for_each_entry(e, qctx->q, list) {
+            h.blob_size += strlen(e->value) + 1;
+            h.elements++;
+        }
+    }
+    fwrite(&h, sizeof(h), 1, f);
+
+    list_for_each_entry(qctx, &chain.head, chain) {
+        uint64_t cnt = 0;
+        struct list_head *node;
+        if (qctx->q) {
+            list_for_each (node, qctx->q)
+                cnt++;
+        }
+        fwrite(&cnt, sizeof(cnt), 1, f);
+    }
+
+    uint64_t offset = 0;
+    list_for_each_entry(qctx, &chain.head, chain) {
+        if (!qctx->q)
+            continue;
+        list_for_each_entry(e, qctx->q, list) {
+            fwrite(&offset, sizeof(offset), 1, f);
+            offset += strlen(e->value) + 1;
+        }
+    }
+
+    list_for_each_entry(qctx, &chain.head, chain) {
+        if (!qctx->q)
+            continue;
+        list_for_each_entry(e, qctx->q, list)
+            fwrite(e->value, 1, strlen(e->value) + 1, f);
+    }
+    return !ferror(f);
+}
+
+static bool do_save(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs a file name", argv[0]);
+        return false;
+    }
+
+    FILE *f = fopen(argv[1], "wb");
+    if (!f) {
+        report(1, "Could not open snapshot '%s'", argv[1]);
+        return false;
+    }
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+    bool ok = false;
+    if (exception_setup(false))
+        ok = save_queues(f);
+    exception_cancel();
+    if (fclose(f) != 0)
+        ok = false;
+    if (!ok)
+        report(1, "Could not write snapshot '%s'", argv[1]);
+    return ok && !error_check();
+}
+
+/* Append a queue holding cnt strings of blob at offsets */
+static bool load_queue(const char *blob,
+                       const uint64_t *offsets,
+                       uint64_t cnt)
+{
+    /* Link the context before calling q_new, so that a failure inside it
+     * leaves a queue the chain can free, as a failed q_new in 'new' does
+     */
+    queue_contex_t *qctx = malloc(sizeof(queue_contex_t));
+    list_add_tail(&qctx->chain, &chain.head);
+    qctx->size = 0;
+    qctx->q = NULL;
+    qctx->id = chain.size++;
+    current = qctx;
+
+    bool ok = false;
+    if (exception_setup(true)) {
+        qctx->q = q_new();
+        ok = qctx->q;
+    }
+    exception_cancel();
+
+    /* Restart the time limit every chunk, as loading is not timed */
+    for (uint64_t i = 0; ok && i < cnt; i += LOAD_CHUNK) {
+        uint64_t end = cnt - i < LOAD_CHUNK ? cnt : i + LOAD_CHUNK;
+        ok = false;
+        if (exception_setup(true)) {
+            uint64_t j = i;
+            /* The strings are mapped read-only and only copied */
+            for (; j < end; j++) {
+                if (!q_insert_tail(current->q, (char *) blob + offsets[j]))
+                    break;
+                current->size++;
+            }
+            ok = j == end;
+        }
+        exception_cancel();
+    }
+    if (!ok)
+        report(1, "ERROR: Could not load queue %d", current->id);
+    return ok && !error_check();
+}
+
+static bool do_load(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs a file name", argv[0]);
+        return false;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fd >= 0 && fstat(fd, &st) == 0 &&
+        (size_t) st.st_size >= sizeof(snapshot_header_t))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (fd >= 0)
+        close(fd);
+    if (map == MAP_FAILED) {
+        report(1, "Could not read snapshot '%s'", argv[1]);
+        return false;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    /* Check the layout before trusting any count or offset */
+    const snapshot_header_t *h = map;
+    const uint64_t *counts = (const uint64_t *) (h + 1);
+    const uint64_t *offsets = counts + h->queues;
+    const char *blob = (const char *) (offsets + h->elements);
+    uint64_t total = 0;
+    bool valid = !memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) &&
+                 h->byte_order == SNAPSHOT_BYTE_ORDER &&
+                 h->elements <= (uint64_t) st.st_size / sizeof(uint64_t) &&
+                 sizeof(*h) + (h->queues + h->elements) * sizeof(uint64_t) +
+                         h->blob_size ==
+                     (uint64_t) st.st_size &&
+                 (!h->blob_size || !blob[h->blob_size - 1]);
+    /* Compare before adding, so that the sum cannot wrap around */
+    for (uint32_t i = 0; valid && i < h->queues; i++) {
+        valid = counts[i] <= h->elements - total;
+        total += counts[i];
+    }
+    for (uint64_t i = 0; valid && i < h->elements; i++)
+        valid = offsets[i] < h->blob_size;
+    if (!valid || total != h->elements) {
+        munmap(map, st.st_size);
+        report(1, "Snapshot '%s' is corrupt", argv[1]);
+        return false;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool ok = true;
+    uint32_t queues = h->queues;
+    for (uint32_t i = 0; ok && i < queues; i++) {
+        ok = load_queue(blob, offsets, counts[i]);
+        offsets += counts[i];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    munmap(map, st.st_size);
+
+    double secs =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    if (ok)
+        report(1, "Loaded %u queues of %lu elements in %.3f s",
+               (unsigned) queues, (unsigned long) total, secs);
+    q_show(3);
+    return ok;
+}
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* Insert the lines of a text file, following each other along the queue in
+ * file order at either end.  Lines are copied out of the mapping to be
+ * terminated.
+ */
+static bool do_loadlines(int argc, char *argv[])
+{
+    position_t pos = POS_TAIL;
+    if (argc == 3 && !strcmp(argv[2], "head"))
+        pos = POS_HEAD;
+    else if (argc != 2 && !(argc == 3 && !strcmp(argv[2], "tail"))) {
+        report(1, "%s needs a file name, then optionally head or tail",
+               argv[0]);
+        return false;
+    }
+    if (!current || !current->q) {
+        report(3, "Warning: Calling loadlines on null queue");
+        return false;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    const char *map = MAP_FAILED;
+    if (fd >= 0 && fstat(fd, &st) == 0)
+        map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+                         : NULL;
+    if (fd >= 0)
+        close(fd);
+    if (map == MAP_FAILED) {
+        report(1, "Could not read '%s'", argv[1]);
+        return false;
+    }
+    size_t size = map ? st.st_size : 0;
+    if (map)
+        madvise((void *) map, size, MADV_SEQUENTIAL);
+
+    /* The unread lines are [begin, end), less a final newline.  Both may
+     * change before an exception, so they are volatile.
+     */
+    const char *volatile begin = map;
+    const char *volatile end = map + size;
+    if (size && end[-1] == '\n')
+        end--;
+    volatile size_t lines = 0;
+    size_t buf_size = 256;
+    char *volatile buf = malloc(buf_size);
+    bool ok = buf;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while (ok && size && begin <= end) {
+        ok = false;
+        if (exception_setup(true)) {
+            int i = 0;
+            for (; i < LOAD_CHUNK && begin <= end; i++) {
+                const char *line, *eol;
+                if (pos == POS_TAIL) {
+                    /* memchr is vectorized by libc */
+                    line = begin;
+                    eol = memchr(line, '\n', end - line);
+                    if (!eol)
+                        eol = end;
+                    begin = eol + 1;
+                } else {
+                    eol = end;
+                    for (line = eol; line > begin && line[-1] != '\n'; line--)
+                        ;
+                    end = line - 1;
+                }
+
+                size_t len = eol - line;
+                if (len && eol[-1] == '\r')
+                    len--;
+                if (len >= buf_size) {
+                    while (len >= buf_size)
+                        buf_size *= 2;
+                    char *p = realloc(buf, buf_size);
+                    if (!p)
+                        break;
+                    buf = p;
+                }
+                memcpy(buf, line, len);
+                buf[len] = '\0';
+                if (!(pos == POS_TAIL ? q_insert_tail(current->q, buf)
+                                      : q_insert_head(current->q, buf)))
+                    break;
+                current->size++;
+                lines++;
+            }
+            ok = i == LOAD_CHUNK || begin > end;
+        }
+        exception_cancel();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    free(buf);
+    if (map)
+        munmap((void *) map, size);
+
+    if (!ok)
+        report(1, "ERROR: Could not insert line %lu of '%s'",
+               (unsigned long) lines + 1, argv[1]);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+    if (secs <= 0)
+        secs = 1e-9;
+    report(1, "Loaded %lu lines, %lu bytes in %.3f s (%.0f lines/s, %.1f MB/s)",
+           (unsigned long) lines, (unsigned long) size, secs, lines / secs,
+           size / secs / 1e6);
+    q_show_ends(3);
+    return ok && !error_check();
+}
+
+/* Write all of iov, resuming after short writes */
+static bool writev_all(int fd, struct iovec *iov, int cnt)
+{
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        for (; cnt > 0 && (size_t) n >= iov->iov_len; iov++, cnt--)
+            n -= iov->iov_len;
+        if (cnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+static bool do_dumplines(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs a file name", argv[0]);
+        return false;
+    }
+    if (!current || !current->q) {
+        report(3, "Warning: Calling dumplines on null queue");
+        return false;
+    }
+
+    int fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        report(1, "Could not open '%s'", argv[1]);
+        return false;
+    }
+
+    /* Each line is its string and a shared newline */
+    static char newline[] = "\n";
+    struct iovec *iov = malloc(IOV_MAX * sizeof(struct iovec));
+    bool ok = iov;
+    int cnt = 0;
+    if (ok && exception_setup(false)) {
+        element_t *e;
+        list_for_each_entry(e, current->q, list) {
+            iov[cnt].iov_base = e->value;
+            iov[cnt++].iov_len = strlen(e->value);
+            iov[cnt].iov_base = newline;
+            iov[cnt++].iov_len = 1;
+            if (cnt + 2 > IOV_MAX) {
+                if (!(ok = writev_all(fd, iov, cnt)))
+                    break;
+                cnt = 0;
+            }
+        }
+        ok = ok && writev_all(fd, iov, cnt);
+    }
+    exception_cancel();
+    free(iov);
+    if (close(fd) != 0)
+        ok = false;
+    if (!ok)
+        report(1, "Could not write '%s'", argv[1]);
+    return ok && !error_check();
+}
+
+/* Per-command memory accounting, combining queue and console allocations */
+static int memstat = 0;
+
+#define MEMSTAT_CMDS 64
+#define MEMSTAT_DEPTH 8
+
+typedef struct {
+    char name[16];
+    size_t calls;
+    size_t allocs, frees;
+    long blocks, bytes; /* Net change over all calls */
+    size_t peak_bytes;  /* Largest growth of live bytes within one call */
+} cmd_memstat_t;
+
+static cmd_memstat_t cmd_memstats[MEMSTAT_CMDS];
+static int cmd_memstat_cnt = 0;
+
+/* Counters when each command in progress started; commands can nest */
+static mem_stat_t memstat_start[MEMSTAT_DEPTH];
+static size_t memstat_peak[MEMSTAT_DEPTH]; /* Outer peak, from mem_peak_begin */
+static bool memstat_started[MEMSTAT_DEPTH];
+static int memstat_depth = 0;
+
+static void mem_stat_sum(mem_stat_t *stat)
+{
+    mem_stat_t console;
+    harness_mem_stat(stat);
+    report_mem_stat(&console);
+    stat->blocks += console.blocks;
+    stat->bytes += console.bytes;
+    stat->allocs += console.allocs;
+    stat->frees += console.frees;
+}
+
+static cmd_memstat_t *find_cmd_memstat(const char *name)
+{
+    for (int i = 0; i < cmd_memstat_cnt; i++) {
+        if (!strcmp(cmd_memstats[i].name, name))
+            return &cmd_memstats[i];
+    }
+    if (cmd_memstat_cnt == MEMSTAT_CMDS)
+        return NULL;
+    cmd_memstat_t *cs = &cmd_memstats[cmd_memstat_cnt++];
+    strncpy(cs->name, name, sizeof(cs->name) - 1);
+    return cs;
+}
+
+/* Number allocations per command for deterministic failure injection */
+static void q_cmd_start(int argc, char *argv[], bool ok)
+{
+    alloc_sequence_reset();
+    if (memstat_depth < MEMSTAT_DEPTH) {
+        memstat_started[memstat_depth] = memstat;
+        if (memstat) {
+            mem_stat_sum(&memstat_start[memstat_depth]);
+            memstat_peak[memstat_depth] = mem_peak_begin();
+        }
+    }
+    memstat_depth++;
+}
+
+static void q_cmd_finish(int argc, char *argv[], bool ok)
+{
+    record_op(argc, argv, ok);
+
+    /* Skip commands that started before accounting was turned on */
+    if (memstat_depth-- > MEMSTAT_DEPTH || !memstat_started[memstat_depth])
+        return;
+    /* Always end the peak measurement, so enclosing commands get it back */
+    size_t peak_end = mem_peak_end(memstat_peak[memstat_depth]);
+    if (!memstat)
+        return;
+
+    const mem_stat_t *start = &memstat_start[memstat_depth];
+    mem_stat_t end;
+    mem_stat_sum(&end);
+    long blocks = (long) end.blocks - (long) start->blocks;
+    long bytes = (long) end.bytes - (long) start->bytes;
+    /* The peak restarted from the start bytes when this command began */
+    size_t peak = peak_end > start->bytes ? peak_end - start->bytes : 0;
+    size_t allocs = end.allocs - start->allocs;
+    size_t frees = end.frees - start->frees;
+    report(1,
+           "Memory: %+ld blocks, %+ld bytes, peak %lu bytes, %lu allocs, %lu "
+           "frees",
+           blocks, bytes, (unsigned long) peak, (unsigned long) allocs,
+           (unsigned long) frees);
+
+    cmd_memstat_t *cs = find_cmd_memstat(argv[0]);
+    if (!cs)
+        return;
+    cs->calls++;
+    cs->allocs += allocs;
+    cs->frees += frees;
+    cs->blocks += blocks;
+    cs->bytes += bytes;
+    if (peak > cs->peak_bytes)
+        cs->peak_bytes = peak;
+}
+
+static bool do_stats(int argc, char *argv[])
+{
+    if (argc == 2 && !strcmp(argv[1], "reset")) {
+        cmd_memstat_cnt = 0;
+        memset(cmd_memstats, 0, sizeof(cmd_memstats));
+        return true;
+    }
+
+    if (argc != 1) {
+        report(1, "%s takes no arguments or 'reset'", argv[0]);
+        return false;
+    }
+
+    if (!memstat)
+        report(1, "Warning: Accounting is off. Use 'option memstat 1'");
+    report(1, "%-12s %8s %10s %10s %10s %12s %12s", "Command", "Calls",
+           "Allocs", "Frees", "Blocks", "Bytes", "Peak");
+    for (int i = 0; i < cmd_memstat_cnt; i++) {
+        const cmd_memstat_t *cs = &cmd_memstats[i];
+        report(1, "%-12s %8lu %10lu %10lu %+10ld %+12ld %12lu", cs->name,
+               (unsigned long) cs->calls, (unsigned long) cs->allocs,
+               (unsigned long) cs->frees, cs->blocks, cs->bytes,
+               (unsigned long) cs->peak_bytes);
+    }
+    return true;
+}
+
+/* Exit codes of failsweep children */
+#define SWEEP_PASS 0
+#define SWEEP_CMD_ERROR 1
+#define SWEEP_LEAK 2
+#define SWEEP_UNREACHED 3
+
+/* Run the command with allocation nth failing, then free every queue.
+ * With nth 0 nothing fails, and the number of allocations the command
+ * attempted is written to count_fd.
+ */
+static void __attribute__((noreturn)) failsweep_child(int nth,
+                                                      int count_fd,
+                                                      int argc,
+                                                      char *argv[])
+{
+    /* Keep the output of concurrent children from interleaving */
+    int fd = open("/dev/null", O_WRONLY);
+    if (fd >= 0) {
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+    }
+    set_verblevel(0);
+    /* Timers are not inherited across fork */
+    time_limit_reset();
+
+    fail_nth = nth;
+    if (!nth)
+        fail_probability = 0;
+    bool ok = interpret_cmda(argc, argv);
+    if (!nth) {
+        size_t cnt = alloc_sequence();
+        if (write(count_fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+            _exit(SWEEP_CMD_ERROR);
+    } else if (alloc_sequence() < (size_t) nth) {
+        _exit(SWEEP_UNREACHED);
+    }
+
+    fail_nth = 0;
+    if (!q_quit(0, NULL))
+        _exit(SWEEP_LEAK);
+    _exit(ok ? SWEEP_PASS : SWEEP_CMD_ERROR);
+}
+
+/* Maximum number of failure points swept by one command */
+#define SWEEP_LIMIT 100000
+
+/* Count the allocations of the command in a child where none fails, or
+ * return -1 if it does not get to the end
+ */
+static long failsweep_count(int argc, char *argv[])
+{
+    int fds[2];
+    if (pipe(fds) < 0)
+        return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        failsweep_child(0, fds[1], argc, argv);
+    }
+    close(fds[1]);
+
+    size_t cnt;
+    bool counted =
+        pid > 0 && read(fds[0], &cnt, sizeof(cnt)) == (ssize_t) sizeof(cnt);
+    close(fds[0]);
+    if (pid > 0)
+        waitpid(pid, NULL, 0);
+    return counted ? (long) cnt : -1;
+}
+
+static bool do_failsweep(int argc, char *argv[])
+{
+    if (argc < 2) {
+        report(1, "%s needs a command to sweep", argv[0]);
+        return false;
+    }
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1)
+        ncpu = 1;
+    pid_t *pids = calloc(ncpu, sizeof(pid_t));
+    int *points = calloc(ncpu, sizeof(int));
+    if (!pids || !points) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for children");
+        free(pids);
+        free(points);
+        return false;
+    }
+
+    /* Do not let children flush our pending output */
+    fflush(stdout);
+
+    /* Sweep no further than the allocations of a run without failures.  A
+     * failure path seldom allocates more, and a command that crashes in
+     * every child would never report the end of its allocations.
+     */
+    long limit = failsweep_count(argc - 1, argv + 1);
+    if (limit < 0) {
+        report(1, "ERROR: Command does not finish without injected failures");
+        free(pids);
+        free(points);
+        return false;
+    }
+    if (limit > SWEEP_LIMIT)
+        limit = SWEEP_LIMIT;
+
+    int nth = 1, running = 0, swept = 0;
+    int cmd_errors = 0, leaks = 0, crashes = 0;
+    bool reached_end = false;
+    while (running > 0 || (!reached_end && nth <= limit)) {
+        /* Keep every core busy with one copy-on-write child */
+        for (long slot = 0; slot < ncpu && !reached_end && nth <= limit;
+             slot++) {
+            if (pids[slot])
+                continue;
+            pid_t pid = fork();
+            if (pid < 0) {
+                report(1, "ERROR: fork failed: %s", strerror(errno));
+                reached_end = true;
+                break;
+            }
+            if (pid == 0)
+                failsweep_child(nth, -1, argc - 1, argv + 1);
+            pids[slot] = pid;
+            points[slot] = nth++;
+            running++;
+        }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0)
+            break;
+        long slot = 0;
+        while (slot < ncpu && pids[slot] != pid)
+            slot++;
+        if (slot == ncpu)
+            continue;
+        pids[slot] = 0;
+        running--;
+
+        int point = points[slot];
+        if (WIFSIGNALED(status)) {
+            report(1, "Allocation #%d: crashed with signal %d (%s)", point,
+                   WTERMSIG(status), strsignal(WTERMSIG(status)));
+            crashes++;
+        } else if (WEXITSTATUS(status) == SWEEP_UNREACHED) {
+            reached_end = true;
+            continue;
+        } else if (WEXITSTATUS(status) == SWEEP_LEAK) {
+            report(1, "Allocation #%d: blocks still allocated after free",
+                   point);
+            leaks++;
+        } else if (WEXITSTATUS(status) != SWEEP_PASS) {
+            report(2, "Allocation #%d: command reported an error", point);
+            cmd_errors++;
+        }
+        swept++;
+    }
+    free(pids);
+    free(points);
+
+    report(1,
+           "Swept %d allocation failure points: %d crashed, %d leaked, %d "
+           "reported errors",
+           swept, crashes, leaks, cmd_errors);
+    return !crashes && !leaks;
+}
+
+static void seed_setter(int oldval)
+{
+    random_seed((unsigned) seed);
+    /* Queue implementations may call rand() too */
+    if (seed)
+        srand(seed);
+}
+
 static void console_init(void)
 {
     ADD_COMMAND(new, "Create new queue", "");
@@ -1083,12 +2729,16 @@ static void console_init(void)
     ADD_COMMAND(next, "Switch to next queue", "");
     ADD_COMMAND(ih,
                 "Insert string str at head of queue n times. Generate random "
-                "string(s) if str equals RAND. (default: n == 1)",
-                "str [n]");
+                "string(s) if str equals RAND, or structured ones with -g "
+                "SORTED, REVSORTED, NEARLYSORTED pct, ZIPF s, FEWUNIQUE k or "
+                "PREFIX len. (default: n == 1)",
+                "str [n] | -g kind [param] [n]");
     ADD_COMMAND(it,
                 "Insert string str at tail of queue n times. Generate random "
-                "string(s) if str equals RAND. (default: n == 1)",
-                "str [n]");
+                "string(s) if str equals RAND, or structured ones with -g "
+                "SORTED, REVSORTED, NEARLYSORTED pct, ZIPF s, FEWUNIQUE k or "
+                "PREFIX len. (default: n == 1)",
+                "str [n] | -g kind [param] [n]");
     ADD_COMMAND(
         rh,
         "Remove from head of queue. Optionally compare to expected value str",
@@ -1115,14 +2765,69 @@ static void console_init(void)
                 "");
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
+    ADD_COMMAND(complexity,
+                "Time operation on doubling queue sizes and classify its "
+                "growth as O(1), O(log n), O(n), O(n log n) or O(n^2)",
+                "op [max_n]");
+    ADD_COMMAND(allocprof,
+                "Show allocations per call site sorted by bytes, or clear them",
+                "[reset]");
+    ADD_COMMAND(failsweep,
+                "Run command once per allocation it makes, failing exactly "
+                "that allocation in a forked child",
+                "cmd arg ...");
+    ADD_COMMAND(record,
+                "Log queue operations and their outcomes to a binary file, or "
+                "stop logging",
+                "[file]");
+    ADD_COMMAND(replay,
+                "Run the operations logged by 'record', reporting throughput, "
+                "latencies and outcomes that differ",
+                "file");
+    ADD_COMMAND(save, "Write all queues to a snapshot file", "file");
+    ADD_COMMAND(load,
+                "Append the queues of a snapshot file, ending at the last",
+                "file");
+    ADD_COMMAND(loadlines,
+                "Insert every line of a text file, in order, at the tail (or "
+                "head) of the queue",
+                "file [head|tail]");
+    ADD_COMMAND(dumplines, "Write the strings of the queue as lines of a file",
+                "file");
+    ADD_COMMAND(profile,
+                "Sample call stacks on CPU time, and write them as folded "
+                "stacks for flamegraph.pl",
+                "start [hz]|stop|dump file");
+    ADD_COMMAND(stats,
+                "Show memory use per command recorded with 'option memstat', "
+                "or clear it",
+                "[reset]");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("timeout_ms", &timeout_ms,
+              "CPU time limit of each queue operation in milliseconds (0 = "
+              "unlimited)", NULL);
+    add_param("malloc_nth", &fail_nth,
+              "Fail only the n-th allocation of each command (0 = off)", NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_param("verify", &verify,
+              "Fully check the queue after every n-th insertion or removal "
+              "(0 = ends only)",
+              NULL);
+    add_param("seed", &seed,
+              "Repeat random strings and allocation failures from this seed "
+              "(0 = unseeded)",
+              seed_setter);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("memstat", &memstat,
+              "Report blocks, bytes, peak, allocations and frees per command",
+              NULL);
+    add_param("allocprof", &alloc_profiling,
+              "Record allocations per call site for 'allocprof'", NULL);
 }
 
 /* Signal handlers */
@@ -1139,6 +2844,8 @@ static void sigsegv_handler(int sig)
 
 static void sigalrm_handler(int sig)
 {
+    if (!time_limit_exceeded())
+        return;
     trigger_exception(
         "Time limit exceeded.  Either you are in an infinite loop, or your "
         "code is too inefficient");
@@ -1149,14 +2856,24 @@ static void q_init(void)
     fail_count = 0;
     INIT_LIST_HEAD(&chain.head);
     signal(SIGSEGV, sigsegv_handler);
-    signal(SIGALRM, sigalrm_handler);
+
+    /* The time limit may fire during a system call, which must not fail */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigalrm_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGALRM, &sa, NULL);
 }
 
 static bool q_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
+    profile_stop();
+    record_close();
+    bool cautious = set_cautious_mode(false);
+    if (!current || current->size <= BIG_LIST_SIZE)
+        set_cautious_mode(cautious);
 
     if (exception_setup(true)) {
         struct list_head *cur = chain.head.next;
@@ -1170,7 +2887,7 @@ static bool q_quit(int argc, char *argv[])
     }
 
     exception_cancel();
-    set_cautious_mode(true);
+    set_cautious_mode(cautious);
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -1456,6 +3173,7 @@ int main(int argc, char *argv[])
         set_logfile(logfile_name);
 
     add_quit_helper(q_quit);
+    add_cmd_hook(q_cmd_start, q_cmd_finish);
 
     bool ok = true;
     ok = ok && run_console(infile_name);
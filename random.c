@@ -28,6 +28,9 @@
 #define _GNU_SOURCE
 #endif
 
+#include <stdbool.h>
+#include <string.h>
+
 #include "random.h"
 
 #if defined(__linux__) || defined(__GNU__)
@@ -272,7 +275,8 @@ static int bsd_randombytes(void *buf, size_t n)
 }
 #endif
 
-int randombytes(uint8_t *buf, size_t n)
+/* Read n bytes of entropy from the operating system */
+static int os_randombytes(uint8_t *buf, size_t n)
 {
 #if defined(__linux__) || defined(__GNU__)
 #if defined(USE_GLIBC)
@@ -291,3 +295,235 @@ int randombytes(uint8_t *buf, size_t n)
 #error "randombytes(...) is not supported on this platform"
 #endif
 }
+
+/* The bytes handed out come from a ChaCha20 keystream keyed once from the
+ * operating system, so most calls need no system call.  Each refill
+ * generates CHACHA_BLOCKS blocks and keys the next refill with the first
+ * 32 bytes, so a later compromise of the state does not reveal earlier
+ * output.
+ */
+#define CHACHA_BLOCKS 64
+#define CHACHA_BUF (CHACHA_BLOCKS * 64)
+#define CHACHA_KEY 32
+
+static uint32_t chacha_key[8];
+static uint32_t chacha_nonce[2];
+static uint8_t chacha_buf[CHACHA_BUF];
+static size_t chacha_avail = 0; /* Unused bytes at the end of chacha_buf */
+static bool chacha_seeded = false;
+
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d) \
+    do {                         \
+        a += b;                  \
+        d = ROTL32(d ^ a, 16);   \
+        c += d;                  \
+        b = ROTL32(b ^ c, 12);   \
+        a += b;                  \
+        d = ROTL32(d ^ a, 8);    \
+        c += d;                  \
+        b = ROTL32(b ^ c, 7);    \
+    } while (0)
+
+static inline void store32_le(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline uint32_t load32_le(const uint8_t *p)
+{
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 |
+           (uint32_t) p[3] << 24;
+}
+
+/* Write the 64-byte keystream block number counter */
+static void chacha20_block(uint8_t *out, uint64_t counter)
+{
+    uint32_t in[16] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+    for (int i = 0; i < 8; i++)
+        in[4 + i] = chacha_key[i];
+    in[12] = counter;
+    in[13] = counter >> 32;
+    in[14] = chacha_nonce[0];
+    in[15] = chacha_nonce[1];
+
+    uint32_t x[16];
+    for (int i = 0; i < 16; i++)
+        x[i] = in[i];
+    for (int i = 0; i < 10; i++) {
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++)
+        store32_le(out + 4 * i, x[i] + in[i]);
+}
+
+static int chacha_refill(void)
+{
+    if (!chacha_seeded) {
+        uint8_t seed[CHACHA_KEY + 8];
+        if (os_randombytes(seed, sizeof(seed)) != 0)
+            return -1;
+        for (int i = 0; i < 8; i++)
+            chacha_key[i] = load32_le(seed + 4 * i);
+        chacha_nonce[0] = load32_le(seed + CHACHA_KEY);
+        chacha_nonce[1] = load32_le(seed + CHACHA_KEY + 4);
+        memset(seed, 0, sizeof(seed));
+        chacha_seeded = true;
+    }
+
+    for (int i = 0; i < CHACHA_BLOCKS; i++)
+        chacha20_block(chacha_buf + 64 * i, i);
+
+    /* Fast key erasure: the first bytes become the next key */
+    for (int i = 0; i < 8; i++)
+        chacha_key[i] = load32_le(chacha_buf + 4 * i);
+    memset(chacha_buf, 0, CHACHA_KEY);
+    chacha_avail = CHACHA_BUF - CHACHA_KEY;
+    return 0;
+}
+
+/* Once seeded, bytes come from xoshiro256** instead, which repeats its
+ * output for the same seed on any machine.
+ */
+static uint64_t xoshiro_state[4];
+static bool xoshiro_seeded = false;
+static uint64_t xoshiro_seed;
+static uint64_t seed_epoch = 1; /* Bumped by every random_seed() */
+
+static inline uint64_t rotl64(uint64_t x, int n)
+{
+    return (x << n) | (x >> (64 - n));
+}
+
+/* by David Blackman and Sebastiano Vigna, see: <https://prng.di.unimi.it/> */
+static uint64_t xoshiro_next_of(uint64_t *s)
+{
+    uint64_t result = rotl64(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl64(s[3], 45);
+    return result;
+}
+
+static inline uint64_t xoshiro_next(void)
+{
+    return xoshiro_next_of(xoshiro_state);
+}
+
+static void xoshiro_bytes(uint8_t *buf, size_t n)
+{
+    for (; n >= 8; buf += 8, n -= 8) {
+        uint64_t x = xoshiro_next();
+        store32_le(buf, x);
+        store32_le(buf + 4, x >> 32);
+    }
+    if (n > 0) {
+        uint8_t tail[8];
+        xoshiro_bytes(tail, sizeof(tail));
+        memcpy(buf, tail, n);
+    }
+}
+
+static uint64_t bit_pool;
+static int bit_count = 0;
+
+/* Expand seed with splitmix64, which never yields an all-zero state */
+static void xoshiro_expand(uint64_t *s, uint64_t seed)
+{
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        s[i] = z ^ (z >> 31);
+    }
+}
+
+void random_seed(uint64_t seed)
+{
+    bit_count = 0;
+    seed_epoch++;
+    xoshiro_seeded = seed != 0;
+    xoshiro_seed = seed;
+    if (xoshiro_seeded)
+        xoshiro_expand(xoshiro_state, seed);
+}
+
+void random_stream_init(random_stream_t *st, uint64_t id)
+{
+    st->id = id;
+    st->epoch = seed_epoch;
+    if (xoshiro_seeded) {
+        /* A multiplier other than the splitmix64 increment keeps the
+         * expansions of different ids from overlapping
+         */
+        xoshiro_expand(st->s, xoshiro_seed ^ (id * 0xd1b54a32d192ed03ULL));
+        return;
+    }
+    do {
+        randombytes((uint8_t *) st->s, sizeof(st->s));
+    } while (!(st->s[0] | st->s[1] | st->s[2] | st->s[3]));
+}
+
+uint64_t random_stream_u64(random_stream_t *st)
+{
+    if (st->epoch != seed_epoch)
+        random_stream_init(st, st->id);
+    return xoshiro_next_of(st->s);
+}
+
+int randombytes(uint8_t *buf, size_t n)
+{
+    if (xoshiro_seeded) {
+        xoshiro_bytes(buf, n);
+        return 0;
+    }
+
+    while (n > 0) {
+        if (chacha_avail == 0 && chacha_refill() != 0)
+            return -1;
+        size_t chunk = n < chacha_avail ? n : chacha_avail;
+        uint8_t *src = chacha_buf + CHACHA_BUF - chacha_avail;
+        memcpy(buf, src, chunk);
+        memset(src, 0, chunk);
+        chacha_avail -= chunk;
+        buf += chunk;
+        n -= chunk;
+    }
+    return 0;
+}
+
+uint64_t random_u64(void)
+{
+    if (xoshiro_seeded)
+        return xoshiro_next();
+    uint8_t buf[8];
+    randombytes(buf, sizeof(buf));
+    return (uint64_t) load32_le(buf + 4) << 32 | load32_le(buf);
+}
+
+/* Bits are handed out from a 64-bit word refilled as it runs out */
+uint8_t randombit(void)
+{
+    if (bit_count == 0) {
+        bit_pool = random_u64();
+        bit_count = 64;
+    }
+    uint8_t ret = bit_pool & 1;
+    bit_pool >>= 1;
+    bit_count--;
+    return ret;
+}
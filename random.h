@@ -6,12 +6,33 @@
 
 extern int randombytes(uint8_t *buf, size_t len);
 
-static inline uint8_t randombit(void)
-{
-    uint8_t ret = 0;
-    randombytes(&ret, 1);
-    return ret & 1;
-}
+/* Return a single random bit */
+uint8_t randombit(void);
+
+/* Return 64 random bits */
+uint64_t random_u64(void);
+
+/* Make every later random byte a deterministic function of seed, or go
+ * back to randomness from the operating system if seed is 0.
+ */
+void random_seed(uint64_t seed);
+
+/* A generator of its own, for consumers whose draws must not move the
+ * stream that workloads take their strings from.  Streams with distinct ids
+ * are independent, and each follows the latest random_seed() on its next
+ * draw.  A zeroed stream is ready to use.
+ */
+typedef struct {
+    uint64_t id;
+    uint64_t epoch; /* Seeding it was started from, 0 if none yet */
+    uint64_t s[4];
+} random_stream_t;
+
+/* Restart stream as number id of the current seed */
+void random_stream_init(random_stream_t *st, uint64_t id);
+
+/* Return 64 random bits of stream */
+uint64_t random_stream_u64(random_stream_t *st);
 
 #if INTPTR_MAX == INT64_MAX
 #define M_INTPTR_SHIFT (3)
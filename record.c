@@ -0,0 +1,169 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "record.h"
+
+static FILE *record_file = NULL;
+
+bool record_open(const char *fname)
+{
+    record_close();
+    record_file = fopen(fname, "wb");
+    if (!record_file)
+        return false;
+    /* Entries are small, so let stdio batch them */
+    setvbuf(record_file, NULL, _IOFBF, 1 << 16);
+    fwrite(RECORD_MAGIC, 1, sizeof(RECORD_MAGIC) - 1, record_file);
+    return true;
+}
+
+void record_close(void)
+{
+    if (record_file)
+        fclose(record_file);
+    record_file = NULL;
+}
+
+bool record_active(void)
+{
+    return record_file;
+}
+
+static void put_varint(uint64_t v)
+{
+    while (v >= 0x80) {
+        putc((v & 0x7f) | 0x80, record_file);
+        v >>= 7;
+    }
+    putc(v, record_file);
+}
+
+static void put_u64(uint64_t v)
+{
+    for (int i = 0; i < 8; i++, v >>= 8)
+        putc(v & 0xff, record_file);
+}
+
+void record_write(unsigned op,
+                  int argc,
+                  char *argv[],
+                  const record_result_t *res)
+{
+    if (!record_file)
+        return;
+
+    put_varint(op);
+    put_varint(argc);
+    for (int i = 0; i < argc; i++) {
+        size_t len = strlen(argv[i]);
+        put_varint(len);
+        fwrite(argv[i], 1, len, record_file);
+    }
+    putc(res->ok, record_file);
+    put_varint(res->size + 1);
+    put_u64(res->head);
+    put_u64(res->tail);
+}
+
+bool record_reader_open(record_reader_t *r, const char *fname)
+{
+    memset(r, 0, sizeof(record_reader_t));
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(RECORD_MAGIC) - 1)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    if (memcmp(map, RECORD_MAGIC, sizeof(RECORD_MAGIC) - 1)) {
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    r->map = map;
+    r->map_size = st.st_size;
+    r->pos = (const uint8_t *) map + sizeof(RECORD_MAGIC) - 1;
+    r->end = (const uint8_t *) map + st.st_size;
+    return true;
+}
+
+void record_reader_close(record_reader_t *r)
+{
+    if (r->map)
+        munmap(r->map, r->map_size);
+    r->map = NULL;
+}
+
+static bool get_varint(record_reader_t *r, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (r->pos == r->end)
+            return false;
+        uint8_t b = *r->pos++;
+        *v |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static bool get_u64(record_reader_t *r, uint64_t *v)
+{
+    if (r->end - r->pos < 8)
+        return false;
+    *v = 0;
+    for (int i = 7; i >= 0; i--)
+        *v = (*v << 8) | r->pos[i];
+    r->pos += 8;
+    return true;
+}
+
+int record_read(record_reader_t *r,
+                unsigned *op,
+                int *argc,
+                char *argv[],
+                char *buf,
+                size_t buf_size,
+                record_result_t *res)
+{
+    if (r->pos == r->end)
+        return 0;
+
+    uint64_t v, cnt;
+    if (!get_varint(r, &v) || !get_varint(r, &cnt) || cnt > RECORD_MAX_ARGS)
+        return -1;
+    *op = v;
+    *argc = cnt;
+
+    for (uint64_t i = 0; i < cnt; i++) {
+        uint64_t len;
+        if (!get_varint(r, &len) || len >= buf_size ||
+            len > (uint64_t) (r->end - r->pos))
+            return -1;
+        memcpy(buf, r->pos, len);
+        buf[len] = '\0';
+        argv[i] = buf;
+        buf += len + 1;
+        buf_size -= len + 1;
+        r->pos += len;
+    }
+
+    if (r->pos == r->end)
+        return -1;
+    res->ok = *r->pos++;
+    if (!get_varint(r, &v) || !get_u64(r, &res->head) ||
+        !get_u64(r, &res->tail))
+        return -1;
+    res->size = (int) v - 1;
+    return 1;
+}
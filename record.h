@@ -0,0 +1,61 @@
+#ifndef LAB0_RECORD_H
+#define LAB0_RECORD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Binary log of queue operations, written by 'record' and read by 'replay'.
+ * The file starts with RECORD_MAGIC, followed by one entry per operation:
+ *   varint opcode, varint argc, and argc times varint length and bytes,
+ *   then the outcome: one byte ok, varint size + 1 (0 without a queue),
+ *   and the hashes of the head and tail strings as 8 little-endian bytes.
+ * Opcodes are defined by the caller.
+ */
+#define RECORD_MAGIC "QREC\1"
+#define RECORD_MAX_ARGS 8
+
+typedef struct {
+    bool ok;
+    int size; /* -1 without a queue */
+    uint64_t head, tail;
+} record_result_t;
+
+/* Start writing operations to fname, ending any earlier log */
+bool record_open(const char *fname);
+
+/* Flush and close the log */
+void record_close(void);
+
+/* True while a log is open */
+bool record_active(void);
+
+/* Append an operation and its outcome */
+void record_write(unsigned op,
+                  int argc,
+                  char *argv[],
+                  const record_result_t *res);
+
+typedef struct {
+    const uint8_t *pos, *end;
+    void *map;
+    size_t map_size;
+} record_reader_t;
+
+/* Map the log fname for reading */
+bool record_reader_open(record_reader_t *r, const char *fname);
+
+/* Decode the next entry, copying its arguments as strings into buf.
+ * Return 1 for an entry, 0 at the end of the log, -1 if it is corrupt.
+ */
+int record_read(record_reader_t *r,
+                unsigned *op,
+                int *argc,
+                char *argv[],
+                char *buf,
+                size_t buf_size,
+                record_result_t *res);
+
+void record_reader_close(record_reader_t *r);
+
+#endif /* LAB0_RECORD_H */
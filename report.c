@@ -96,7 +96,6 @@ void report_event(message_t msg, char *fmt, ...)
 }
 
 #define BUF_SIZE 4096
-extern int web_connfd;
 void report(int level, char *fmt, ...)
 {
     if (!verbfile)
@@ -196,6 +195,12 @@ static size_t free_bytes = 0;
 static size_t peak_bytes = 0;
 static size_t last_peak_bytes = 0;
 static size_t current_bytes = 0;
+static size_t other_bytes = 0; /* Counted by mem_track_alloc/free */
+
+static void note_peak(void)
+{
+    last_peak_bytes = MAX(last_peak_bytes, current_bytes + other_bytes);
+}
 
 static void check_exceed(size_t new_bytes)
 {
@@ -222,7 +227,7 @@ void *malloc_or_fail(size_t bytes, const char *fun_name)
     allocate_bytes += bytes;
     current_bytes += bytes;
     peak_bytes = MAX(peak_bytes, current_bytes);
-    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
+    note_peak();
 
     return p;
 }
@@ -241,7 +246,7 @@ void *calloc_or_fail(size_t cnt, size_t bytes, const char *fun_name)
     allocate_bytes += cnt * bytes;
     current_bytes += cnt * bytes;
     peak_bytes = MAX(peak_bytes, current_bytes);
-    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
+    note_peak();
 
     return p;
 }
@@ -261,7 +266,7 @@ char *strsave_or_fail(const char *s, const char *fun_name)
     allocate_bytes += len + 1;
     current_bytes += len + 1;
     peak_bytes = MAX(peak_bytes, current_bytes);
-    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
+    note_peak();
 
     // cppcheck-suppress returnDanglingLifetime
     return strncpy(ss, s, len + 1);
@@ -305,6 +310,40 @@ void free_string(char *s)
     free_block((void *) s, strlen(s) + 1);
 }
 
+void report_mem_stat(mem_stat_t *stat)
+{
+    stat->blocks = allocate_cnt - free_cnt;
+    stat->bytes = current_bytes;
+    stat->allocs = allocate_cnt;
+    stat->frees = free_cnt;
+}
+
+void mem_track_alloc(size_t bytes)
+{
+    other_bytes += bytes;
+    note_peak();
+}
+
+void mem_track_free(size_t bytes)
+{
+    other_bytes -= bytes;
+}
+
+size_t mem_peak_begin(void)
+{
+    size_t saved = last_peak_bytes;
+    last_peak_bytes = current_bytes + other_bytes;
+    return saved;
+}
+
+/* An enclosing measurement sees the peaks of the ones nested in it */
+size_t mem_peak_end(size_t saved)
+{
+    size_t peak = last_peak_bytes;
+    last_peak_bytes = MAX(saved, peak);
+    return peak;
+}
+
 /* Initialization of timers */
 void init_time(double *timep)
 {
@@ -313,9 +352,9 @@ void init_time(double *timep)
 
 double delta_time(double *timep)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    double current_time = tv.tv_sec + 1.0E-6 * tv.tv_usec;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double current_time = ts.tv_sec + 1.0E-9 * ts.tv_nsec;
     double delta = current_time - *timep;
     *timep = current_time;
     return delta;
@@ -44,6 +44,30 @@ void free_array(void *b, size_t cnt, size_t bytes);
 /* Free string saved by strsave_or_fail */
 void free_string(char *s);
 
+/* Memory accounting counters */
+typedef struct {
+    size_t blocks;     /* Blocks currently allocated */
+    size_t bytes;      /* Bytes currently allocated */
+    size_t allocs;     /* Total number of allocations */
+    size_t frees;      /* Total number of frees */
+} mem_stat_t;
+
+/* Get counters of the malloc_or_fail family */
+void report_mem_stat(mem_stat_t *stat);
+
+/* Count bytes of other allocators, such as the test harness, so that peaks
+ * cover them together with the malloc_or_fail family.
+ */
+void mem_track_alloc(size_t bytes);
+void mem_track_free(size_t bytes);
+
+/* Start measuring the peak of live bytes from the current usage.
+ * Measurements may nest; pass the returned value to the matching
+ * mem_peak_end(), which gives the peak since this call.
+ */
+size_t mem_peak_begin(void);
+size_t mem_peak_end(size_t saved);
+
 /* Time counted as fp number in seconds */
 void init_time(double *timep);
 
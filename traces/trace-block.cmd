@@ -0,0 +1,18 @@
+# Test blocks of 'repeat' and 'for', and braces as strings for other commands: 'q_new', 'q_insert_tail', 'q_remove_head', and 'q_free'
+option fail 0
+option malloc 0
+new
+it {
+it }
+repeat 2 {
+it x
+}
+for i in 1..3 { it v$i }
+rh {
+rh }
+rh x
+rh x
+rh v1
+rh v2
+rh v3
+free
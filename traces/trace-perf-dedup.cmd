@@ -0,0 +1,23 @@
+# Time 'q_delete_dup' on sorted inputs with few to many duplicates: 'q_new', 'q_free', 'q_insert_tail', 'q_sort', and 'q_delete_dup'
+option fail 0
+option malloc 0
+option seed 1
+new
+it -g SORTED 200000
+time dedup
+free
+new
+it -g FEWUNIQUE 16 200000
+sort
+time dedup
+free
+new
+it -g ZIPF 1.1 200000
+sort
+time dedup
+free
+new
+it -g PREFIX 64 200000
+sort
+time dedup
+free
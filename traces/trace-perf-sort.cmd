@@ -0,0 +1,32 @@
+# Time 'q_sort' on inputs of different shapes to show how adaptive it is: 'q_new', 'q_free', 'q_insert_tail', and 'q_sort'
+option fail 0
+option malloc 0
+option seed 1
+new
+it RAND 200000
+time sort
+free
+new
+it -g SORTED 200000
+time sort
+free
+new
+it -g REVSORTED 200000
+time sort
+free
+new
+it -g NEARLYSORTED 1 200000
+time sort
+free
+new
+it -g FEWUNIQUE 16 200000
+time sort
+free
+new
+it -g ZIPF 1.1 200000
+time sort
+free
+new
+it -g PREFIX 64 200000
+time sort
+free
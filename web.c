@@ -2,79 +2,227 @@
  * MIT License.
  */
 
-#include <arpa/inet.h> /* inet_ntoa */
+#include <arpa/inet.h> /* htonl */
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/tcp.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#include "list.h"
+#include "web.h"
+
 #define LISTENQ 1024 /* second argument to listen() */
 #define MAXLINE 1024 /* max length of a line */
-#define BUFSIZE 1024
+#define BUFSIZE 4096 /* max length of a request header */
+#define MAXEVENTS 64 /* events handled per wakeup */
+#define OUTSIZE 4096 /* initial size of a response buffer */
+#define OUTBATCH 65536 /* pending output sent before the next request */
 
 #ifndef DEFAULT_PORT
 #define DEFAULT_PORT 9999 /* use this port if none given as arg to main() */
 #endif
 
-#if defined(__APPLE__) || defined(__FreeBSD__)
-#define TCP_CORK TCP_NOPUSH
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
 #endif
 
-static int server_fd;
+/* A client is READING until a request is complete, then READY until the
+ * console picks up its command, RUNNING while the command executes, and
+ * WRITING until the buffered output has been sent. A persistent connection
+ * then goes back to READY if the client already sent the next request, or
+ * to READING otherwise.
+ */
+typedef enum {
+    CONN_READING,
+    CONN_READY,
+    CONN_RUNNING,
+    CONN_WRITING,
+} conn_state_t;
 
 typedef struct {
-    int fd;            /* descriptor for this buf */
-    int count;         /* unread byte in this buf */
-    char *bufptr;      /* next unread byte in this buf */
-    char buf[BUFSIZE]; /* internal buffer */
-} rio_t;
+    int fd;
+    conn_state_t state;
+    int events;      /* What the mux is watching for */
+    bool keep_alive; /* Whether the current request leaves the link open */
+    size_t in_pos, in_len;
+    char in[BUFSIZE];
+    char cmd[MAXLINE];
+    char *out;
+    size_t out_len, out_pos, out_size;
+    size_t body_pos; /* Start of the output of the running command */
+    struct list_head ready; /* Entry of ready_list while READY */
+} web_conn_t;
+
+static int server_fd;
+static LIST_HEAD(ready_list);
+static web_conn_t *running = NULL;
+
+/* Connection whose command is running, so that report() reaches it */
+int web_connfd = 0;
+
+/* Readiness of stdin, the listener and the clients comes from epoll on
+ * Linux and from poll elsewhere. Events carry a tag, which is either the
+ * connection or one of the markers below.
+ */
+#define MUX_IN 1
+#define MUX_OUT 2
+
+static char stdin_tag, server_tag;
 
 typedef struct {
-    char filename[512];
-    off_t offset; /* for support Range */
-    size_t end;
-} http_request_t;
+    void *tag;
+    int events;
+} mux_event_t;
 
-static void rio_readinitb(rio_t *rp, int fd)
+#ifdef __linux__
+static int epoll_fd = -1;
+
+static int mux_init(void)
 {
-    rp->fd = fd;
-    rp->count = 0;
-    rp->bufptr = rp->buf;
+    if (epoll_fd < 0)
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    return epoll_fd < 0 ? -1 : 0;
 }
 
-/* This is a wrapper for the Unix read() function that transfers min(n, count)
- * bytes from an internal buffer to a user buffer, where n is the number of
- * bytes requested by the user and count is the number of unread bytes in the
- * internal buffer. On entry, rio_read() refills the internal buffer via a call
- * to read() if the internal buffer is empty.
- */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+static int mux_ctl(int op, int fd, int events, void *tag)
 {
-    int cnt;
-    while (rp->count <= 0) { /* refill if buf is empty */
-        rp->count = read(rp->fd, rp->buf, sizeof(rp->buf));
-        if (rp->count < 0) {
-            if (errno != EINTR) /* interrupted by sig handler return */
-                return -1;
-        } else if (rp->count == 0) { /* EOF */
-            return 0;
-        } else
-            rp->bufptr = rp->buf; /* reset buffer ptr */
+    struct epoll_event ev = {
+        .events = (events & MUX_IN ? EPOLLIN : 0) |
+                  (events & MUX_OUT ? EPOLLOUT : 0),
+        .data.ptr = tag,
+    };
+    return epoll_ctl(epoll_fd, op, fd, &ev);
+}
+
+static int mux_add(int fd, int events, void *tag)
+{
+    return mux_ctl(EPOLL_CTL_ADD, fd, events, tag);
+}
+
+static int mux_mod(int fd, int events, void *tag)
+{
+    return mux_ctl(EPOLL_CTL_MOD, fd, events, tag);
+}
+
+/* Closing the descriptor is enough to remove it from the epoll set */
+static void mux_del(int fd) {}
+
+static int mux_wait(mux_event_t *evs, int timeout)
+{
+    struct epoll_event ev[MAXEVENTS];
+    int n = epoll_wait(epoll_fd, ev, MAXEVENTS, timeout);
+    for (int i = 0; i < n; i++) {
+        evs[i].tag = ev[i].data.ptr;
+        evs[i].events =
+            (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) ? MUX_IN : 0) |
+            (ev[i].events & EPOLLOUT ? MUX_OUT : 0);
     }
+    return n;
+}
+
+#else
+
+static struct pollfd *pfds = NULL;
+static void **ptags = NULL;
+static int pfd_cnt = 0, pfd_size = 0;
+
+static int mux_init(void)
+{
+    return 0;
+}
 
-    /* Copy min(n, rp->count) bytes from internal buf to user buf */
-    cnt = n;
-    if (rp->count < n)
-        cnt = rp->count;
-    memcpy(usrbuf, rp->bufptr, cnt);
-    rp->bufptr += cnt;
-    rp->count -= cnt;
+static short poll_events(int events)
+{
+    return (events & MUX_IN ? POLLIN : 0) | (events & MUX_OUT ? POLLOUT : 0);
+}
+
+static int mux_find(int fd)
+{
+    for (int i = 0; i < pfd_cnt; i++) {
+        if (pfds[i].fd == fd)
+            return i;
+    }
+    return -1;
+}
+
+static int mux_add(int fd, int events, void *tag)
+{
+    if (pfd_cnt == pfd_size) {
+        int size = pfd_size ? 2 * pfd_size : 16;
+        struct pollfd *p = realloc(pfds, size * sizeof(struct pollfd));
+        if (!p)
+            return -1;
+        pfds = p;
+        void **t = realloc(ptags, size * sizeof(void *));
+        if (!t)
+            return -1;
+        ptags = t;
+        pfd_size = size;
+    }
+    pfds[pfd_cnt].fd = fd;
+    pfds[pfd_cnt].events = poll_events(events);
+    pfds[pfd_cnt].revents = 0;
+    ptags[pfd_cnt++] = tag;
+    return 0;
+}
+
+static int mux_mod(int fd, int events, void *tag)
+{
+    int i = mux_find(fd);
+    if (i < 0)
+        return -1;
+    pfds[i].events = poll_events(events);
+    ptags[i] = tag;
+    return 0;
+}
+
+static void mux_del(int fd)
+{
+    int i = mux_find(fd);
+    if (i < 0)
+        return;
+    pfd_cnt--;
+    pfds[i] = pfds[pfd_cnt];
+    ptags[i] = ptags[pfd_cnt];
+}
+
+static int mux_wait(mux_event_t *evs, int timeout)
+{
+    int n = poll(pfds, pfd_cnt, timeout);
+    if (n <= 0)
+        return n;
+
+    int cnt = 0;
+    for (int i = 0; i < pfd_cnt && cnt < MAXEVENTS; i++) {
+        short re = pfds[i].revents;
+        if (!re)
+            continue;
+        evs[cnt].tag = ptags[i];
+        evs[cnt++].events = (re & (POLLIN | POLLHUP | POLLERR) ? MUX_IN : 0) |
+                            (re & POLLOUT ? MUX_OUT : 0);
+    }
     return cnt;
 }
+#endif /* __linux__ */
+
+static int set_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
 static ssize_t writen(int fd, void *usrbuf, size_t n)
 {
@@ -95,32 +243,36 @@ static ssize_t writen(int fd, void *usrbuf, size_t n)
     return n;
 }
 
-/* robustly read a text line (buffered) */
-static ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+static bool conn_reserve(web_conn_t *c, size_t len)
 {
-    char c, *bufp = usrbuf;
-
-    int n;
-    for (n = 1; n < maxlen; n++) {
-        int rc;
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            break;        /* EOF, some data was read */
-        } else
-            return -1; /* error */
-    }
-    *bufp = 0;
-    return n;
+    if (c->out_len + len <= c->out_size)
+        return true;
+    size_t size = c->out_size ? c->out_size : OUTSIZE;
+    while (size < c->out_len + len)
+        size *= 2;
+    char *out = realloc(c->out, size);
+    if (!out)
+        return false;
+    c->out = out;
+    c->out_size = size;
+    return true;
+}
+
+/* Collect output of the running command, to be sent once it finishes */
+static void conn_append(web_conn_t *c, const char *buf, size_t len)
+{
+    if (!conn_reserve(c, len))
+        return;
+    memcpy(c->out + c->out_len, buf, len);
+    c->out_len += len;
 }
 
 void web_send(int out_fd, char *buf)
 {
-    writen(out_fd, buf, strlen(buf));
+    if (running && out_fd == running->fd)
+        conn_append(running, buf, strlen(buf));
+    else
+        writen(out_fd, buf, strlen(buf));
 }
 
 int web_open(int port)
@@ -137,12 +289,6 @@ int web_open(int port)
                    sizeof(int)) < 0)
         return -1;
 
-    // 6 is TCP's protocol number
-    // enable this, much faster : 4000 req/s -> 17000 req/s
-    if (setsockopt(listenfd, IPPROTO_TCP, TCP_CORK, (const void *) &optval,
-                   sizeof(int)) < 0)
-        return -1;
-
     /* Listenfd will be an endpoint for all requests to port
        on any IP address for this host */
     memset(&serveraddr, 0, sizeof(serveraddr));
@@ -156,6 +302,17 @@ int web_open(int port)
     if (listen(listenfd, LISTENQ) < 0)
         return -1;
 
+    /* Accept until the backlog is drained, without blocking */
+    if (set_nonblock(listenfd) < 0 || mux_init() < 0 ||
+        mux_add(listenfd, MUX_IN, &server_tag) < 0)
+        return -1;
+
+    /* Commands come from a terminal only, which can always be polled.
+     * Other kinds of stdin never reach web_eventmux(), so a failure here is
+     * harmless.
+     */
+    mux_add(STDIN_FILENO, MUX_IN, &stdin_tag);
+
     server_fd = listenfd;
 
     return listenfd;
@@ -166,7 +323,8 @@ static void url_decode(char *src, char *dest, int max)
     char *p = src;
     char code[3] = {0};
     while (*p && --max) {
-        if (*p == '%') {
+        if (*p == '%' && isxdigit((unsigned char) p[1]) &&
+            isxdigit((unsigned char) p[2])) {
             memcpy(code, ++p, 2);
             *dest++ = (char) strtoul(code, NULL, 16);
             p += 2;
@@ -177,27 +335,68 @@ static void url_decode(char *src, char *dest, int max)
     *dest = '\0';
 }
 
-static void parse_request(int fd, http_request_t *req)
+/* Length of the request header at the start of buf, or 0 if incomplete */
+static size_t header_length(const char *buf, size_t len)
+{
+    const char *p = buf, *end = buf + len;
+    while ((p = memchr(p, '\n', end - p))) {
+        p++;
+        if (p < end && *p == '\r') /* \n\n || \r\n\r\n */
+            p++;
+        if (p < end && *p == '\n')
+            return p + 1 - buf;
+    }
+    return 0;
+}
+
+/* Copy the line at p, without its line break, into buf of MAXLINE bytes.
+ * Return the start of the following line.
+ */
+static const char *copy_line(const char *p, const char *end, char *buf)
+{
+    const char *eol = memchr(p, '\n', end - p);
+    size_t len = (eol ? eol : end) - p;
+    if (len && p[len - 1] == '\r')
+        len--;
+    if (len > MAXLINE - 1)
+        len = MAXLINE - 1;
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    return eol ? eol + 1 : end;
+}
+
+/* Turn the request line into a command, e.g. "GET /it/x" into "it x", and
+ * look for the headers deciding whether the connection stays open and how
+ * long the body is.
+ */
+static void parse_request(const char *req,
+                          size_t hlen,
+                          char *cmd,
+                          bool *keep_alive,
+                          size_t *body)
 {
-    rio_t rio;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
-    req->offset = 0;
-    req->end = 0; /* default */
-
-    rio_readinitb(&rio, fd);
-    rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%1023s %1023s", method, uri); /* version is not cared */
-    /* read all */
-    while (buf[0] != '\n' && buf[1] != '\n') { /* \n || \r\n */
-        rio_readlineb(&rio, buf, MAXLINE);
-        if (buf[0] == 'R' && buf[1] == 'a' && buf[2] == 'n') {
-            sscanf(buf, "Range: bytes=%lu-%lu", (unsigned long *) &req->offset,
-                   (unsigned long *) &req->end);
-            /* Range: [start, end] */
-            if (req->end != 0)
-                req->end++;
+    char buf[MAXLINE], method[MAXLINE];
+    char uri[MAXLINE] = "", version[MAXLINE] = "";
+    const char *end = req + hlen;
+    const char *p = copy_line(req, end, buf);
+    sscanf(buf, "%1023s %1023s %1023s", method, uri, version);
+
+    /* Only HTTP/1.1 keeps the connection by default */
+    *keep_alive = !strcmp(version, "HTTP/1.1");
+    *body = 0;
+    while (p < end) {
+        p = copy_line(p, end, buf);
+        if (!strncasecmp(buf, "Connection:", 11)) {
+            char *value = buf + 11 + strspn(buf + 11, " \t");
+            if (!strncasecmp(value, "close", 5))
+                *keep_alive = false;
+            else if (!strncasecmp(value, "keep-alive", 10))
+                *keep_alive = true;
+        } else if (!strncasecmp(buf, "Content-Length:", 15)) {
+            *body = strtoul(buf + 15, NULL, 10);
         }
     }
+
     char *filename = uri;
     if (uri[0] == '/') {
         filename = uri + 1;
@@ -213,59 +412,237 @@ static void parse_request(int fd, http_request_t *req)
             }
         }
     }
-    url_decode(filename, req->filename, MAXLINE);
+    url_decode(filename, cmd, MAXLINE);
+
+    /* Change '/' to ' ' */
+    while (*cmd) {
+        ++cmd;
+        if (*cmd == '/')
+            *cmd = ' ';
+    }
 }
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr)
+static void conn_watch(web_conn_t *c, int events)
 {
-    http_request_t req;
-    parse_request(fd, &req);
+    if (c->events != events && !mux_mod(c->fd, events, c))
+        c->events = events;
+}
 
-    char *p = req.filename;
-    /* Change '/' to ' ' */
-    while (*p) {
-        ++p;
-        if (*p == '/')
-            *p = ' ';
+static void conn_close(web_conn_t *c)
+{
+    mux_del(c->fd);
+    close(c->fd);
+    free(c->out);
+    free(c);
+}
+
+/* Take the next request out of the input buffer and queue the connection
+ * for the console. Return false if no complete request is buffered.
+ */
+static bool conn_next(web_conn_t *c)
+{
+    const char *req = c->in + c->in_pos;
+    size_t avail = c->in_len - c->in_pos, body;
+    size_t hlen = header_length(req, avail);
+    bool keep_alive;
+    if (!hlen)
+        return false;
+    parse_request(req, hlen, c->cmd, &keep_alive, &body);
+    if (body > avail - hlen)
+        return false;
+
+    /* A body carries nothing for the console, so it is skipped */
+    c->in_pos += hlen + body;
+    c->keep_alive = keep_alive;
+    c->state = CONN_READY;
+    conn_watch(c, 0);
+    list_add_tail(&c->ready, &ready_list);
+    return true;
+}
+
+/* Send buffered output, and wait for the socket to drain if it is full */
+static void conn_flush(web_conn_t *c)
+{
+    while (c->out_pos < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_pos, c->out_len - c->out_pos,
+                         MSG_NOSIGNAL);
+        if (n > 0) {
+            c->out_pos += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            c->state = CONN_WRITING;
+            conn_watch(c, MUX_OUT);
+            return;
+        } else {
+            conn_close(c); /* the client went away */
+            return;
+        }
     }
-    char *ret = malloc(strlen(req.filename) + 1);
-    strncpy(ret, req.filename, strlen(req.filename) + 1);
 
-    return ret;
+    if (!c->keep_alive) {
+        conn_close(c);
+        return;
+    }
+    c->out_len = c->out_pos = 0;
+    if (!conn_next(c)) {
+        c->state = CONN_READING;
+        conn_watch(c, MUX_IN);
+    }
 }
 
-int web_eventmux(char *buf, size_t buflen)
+/* Read what has arrived, and queue the connection once a request is whole */
+static void conn_read(web_conn_t *c)
 {
-    fd_set listenset;
-
-    FD_ZERO(&listenset);
-    FD_SET(STDIN_FILENO, &listenset);
-    int max_fd = STDIN_FILENO;
-    if (server_fd > 0) {
-        FD_SET(server_fd, &listenset);
-        max_fd = max_fd > server_fd ? max_fd : server_fd;
+    if (c->in_pos) {
+        c->in_len -= c->in_pos;
+        memmove(c->in, c->in + c->in_pos, c->in_len);
+        c->in_pos = 0;
     }
-    int result = select(max_fd + 1, &listenset, NULL, NULL, NULL);
-    if (result < 0)
-        return -1;
 
-    if (server_fd > 0 && FD_ISSET(server_fd, &listenset)) {
-        FD_CLR(server_fd, &listenset);
-        struct sockaddr_in clientaddr;
-        socklen_t clientlen = sizeof(clientaddr);
-        int web_connfd =
-            accept(server_fd, (struct sockaddr *) &clientaddr, &clientlen);
-
-        char *p = web_recv(web_connfd, &clientaddr);
-        char *buffer = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n";
-        web_send(web_connfd, buffer);
-        strncpy(buf, p, buflen);
-        buf[buflen] = '\0';
-        free(p);
-        close(web_connfd);
-        return strlen(buf);
+    bool eof = false;
+    while (c->in_len < sizeof(c->in)) {
+        size_t room = sizeof(c->in) - c->in_len;
+        ssize_t n = read(c->fd, c->in + c->in_len, room);
+        if (n > 0) {
+            c->in_len += n;
+            if ((size_t) n < room)
+                break; /* drained, no need to wait for EAGAIN */
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            eof = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+            break;
+        }
     }
 
-    FD_CLR(STDIN_FILENO, &listenset);
-    return 0;
+    if (!conn_next(c) && (eof || c->in_len == sizeof(c->in)))
+        conn_close(c);
+}
+
+static void web_accept(void)
+{
+    while (1) {
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd < 0)
+            return; /* drained, or out of descriptors until one closes */
+
+        /* Each response goes out in one send, so there is nothing to gain
+         * from waiting for more data before transmitting.
+         */
+        int optval = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void *) &optval,
+                   sizeof(int));
+
+        web_conn_t *c = malloc(sizeof(web_conn_t));
+        if (!c || set_nonblock(fd) < 0 || mux_add(fd, MUX_IN, c) < 0) {
+            free(c);
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->state = CONN_READING;
+        c->events = MUX_IN;
+        c->keep_alive = false;
+        c->in_pos = c->in_len = 0;
+        c->out = NULL;
+        c->out_len = c->out_pos = c->out_size = 0;
+    }
+}
+
+/* Hand the command of c to the console, collecting what it reports */
+static int conn_start(web_conn_t *c, char *buf, size_t buflen)
+{
+    list_del(&c->ready);
+    c->state = CONN_RUNNING;
+    c->body_pos = c->out_len;
+    running = c;
+    web_connfd = c->fd;
+
+    size_t len = strlen(c->cmd);
+    if (len > buflen)
+        len = buflen;
+    memcpy(buf, c->cmd, len);
+    buf[len] = '\0';
+    return len;
+}
+
+/* Put the header in front of the output of the command. Responses to
+ * pipelined requests are sent together, once no further request is
+ * buffered or enough output is pending.
+ */
+static void conn_finish(web_conn_t *c)
+{
+    running = NULL;
+    web_connfd = 0;
+
+    char header[128];
+    size_t body = c->out_len - c->body_pos;
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                       "Content-Length: %lu\r\nConnection: %s\r\n\r\n",
+                       (unsigned long) body,
+                       c->keep_alive ? "keep-alive" : "close");
+    if (!conn_reserve(c, len)) {
+        /* Send what was answered so far, then give up on this client */
+        c->out_len = c->body_pos;
+        c->keep_alive = false;
+    } else {
+        char *p = c->out + c->body_pos;
+        memmove(p + len, p, body);
+        memcpy(p, header, len);
+        c->out_len += len;
+    }
+
+    if (c->keep_alive && c->out_len < OUTBATCH && conn_next(c))
+        return;
+    conn_flush(c);
+}
+
+/* Called by linenoise before each key read. Returns 0 when a key is waiting,
+ * or the length of a command from a client, which is stored in buf. Clients
+ * are served one command at a time, in the order their requests completed.
+ */
+int web_eventmux(char *buf, size_t buflen)
+{
+    /* The console has finished the command handed out last time */
+    if (running)
+        conn_finish(running);
+
+    while (1) {
+        mux_event_t evs[MAXEVENTS];
+        int n = mux_wait(evs, list_empty(&ready_list) ? -1 : 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        bool key = false;
+        for (int i = 0; i < n; i++) {
+            if (evs[i].tag == &stdin_tag) {
+                key = true;
+            } else if (evs[i].tag == &server_tag) {
+                web_accept();
+            } else {
+                web_conn_t *c = evs[i].tag;
+                if (c->state == CONN_READING && (evs[i].events & MUX_IN))
+                    conn_read(c);
+                else if (c->state == CONN_WRITING)
+                    conn_flush(c);
+            }
+        }
+
+        /* Keys go first so that the console stays responsive */
+        if (key)
+            return 0;
+
+        while (!list_empty(&ready_list)) {
+            web_conn_t *c = list_first_entry(&ready_list, web_conn_t, ready);
+            int len = conn_start(c, buf, buflen);
+            if (len > 0)
+                return len;
+            conn_finish(c); /* nothing to run */
+        }
+    }
 }
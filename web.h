@@ -1,11 +1,12 @@
 #ifndef TINYWEB_H
 #define TINYWEB_H
 
-#include <netinet/in.h>
+#include <stddef.h>
 
-int web_open(int port);
+/* Client whose command is running, or 0 */
+extern int web_connfd;
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr);
+int web_open(int port);
 
 void web_send(int out_fd, char *buffer);
 